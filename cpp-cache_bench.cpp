@@ -0,0 +1,451 @@
+//
+// Benchmarks of the cache under realistic workloads
+//
+
+# include <cmath>
+# include <cstdint>
+# include <algorithm>
+# include <atomic>
+# include <chrono>
+# include <fstream>
+# include <functional>
+# include <memory>
+# include <mutex>
+# include <random>
+# include <sstream>
+# include <string>
+# include <thread>
+# include <vector>
+# include <benchmark/benchmark.h>
+# include "cpp-cache.H"
+# include "sharded-cache.H"
+
+using namespace std;
+using namespace std::chrono;
+
+/* Every benchmark runs a stream of operations on a cache shared by all
+   its threads. An operation is a read (retrieve_from_cache_or_compute())
+   or a write (remove() and insert() of the key). The miss handler spins
+   for miss_cost, as a call to a backend would take.
+
+   The keys are drawn by one of these patterns:
+
+   - zipf: Zipfian distribution with skew zipf_theta over num_keys keys,
+     as YCSB draws them.
+
+   - scan: zipf, but every read starts, with probability scan_probability,
+     a scan of scan_length consecutive keys that are never read again.
+     Those scans flush the lru of a cache that does not resist them.
+
+   - hotspot: hot_probability of the reads go to a hot set of
+     hot_fraction of the keys, and the rest are uniform. The hot set
+     moves to the next keys every hot_period operations.
+
+   - trace: the operations are replayed from a file (see load_trace()).
+
+   Two arguments set the mix: write_pct is the percentage of writes and
+   miss_pct the percentage of reads of keys that were never seen, which
+   always miss. The cache is warmed up before every run and the reported
+   figures only count the measured operations:
+
+   - items_per_second: operations per second of all the threads.
+   - p50_ns, p99_ns, p999_ns: latency percentiles of an operation,
+     sampled every sample_period operations.
+   - hit_ratio: from the statistics of the cache (see cache-stats.H).
+
+   Besides the flags of Google Benchmark, the binary accepts
+   --trace=<file>, which registers the replay of the file, and
+   --trace_capacity=<n>, the capacity of the cache for the replay.
+*/
+
+constexpr uint64_t num_keys = 1 << 20;
+constexpr size_t dft_capacity = num_keys / 10;
+constexpr double zipf_theta = 0.99;
+constexpr double scan_probability = 0.001;
+constexpr uint64_t scan_length = 1000;
+constexpr double hot_fraction = 0.01;
+constexpr double hot_probability = 0.9;
+constexpr uint64_t hot_period = 100000;
+constexpr uint64_t sample_period = 8;
+constexpr auto miss_cost = 2us;
+
+// the keys of the scans and of the forced misses are never drawn again
+constexpr uint64_t scan_keys_base = uint64_t(1) << 40;
+constexpr uint64_t miss_keys_base = uint64_t(1) << 48;
+
+enum class KeyPattern { zipf, scan, hotspot, trace };
+
+struct Operation
+{
+  uint64_t key;
+  bool write;
+};
+
+vector<Operation> trace; // loaded by main() if --trace was given
+size_t trace_capacity = dft_capacity;
+
+// Loads a trace file. Every line is an operation: an optional r (read) or
+// w (write) and a key. A key that is not a decimal number is hashed, so
+// that traces of string keys can be replayed as well. Empty lines and
+// lines starting with # are ignored
+vector<Operation> load_trace(const string &path)
+{
+  ifstream in(path);
+  ah_runtime_error_if(not in) << "cannot open trace " << path;
+
+  vector<Operation> ops;
+  string line, first, second;
+  while (getline(in, line))
+    {
+      if (line.empty() or line[0] == '#')
+        continue;
+
+      istringstream fields(line);
+      first.clear();
+      second.clear();
+      fields >> first >> second;
+      if (first.empty())
+        continue;
+
+      const bool has_op = not second.empty() and (first == "r" or first == "w");
+      const string &key = has_op ? second : first;
+      uint64_t k = 0;
+      const bool numeric = all_of(key.begin(), key.end(),
+                                  [] (char c) { return c >= '0' and c <= '9'; });
+      if (numeric)
+        k = stoull(key);
+      else
+        k = std::hash<string>()(key);
+      ops.push_back({ k, has_op and first == "w" });
+    }
+
+  ah_domain_error_if(ops.empty()) << "trace " << path << " is empty";
+
+  return ops;
+}
+
+// Zipfian ranks in [0, n) through the method of Gray et al. ("Quickly
+// generating billion-record synthetic databases"), as used by YCSB. The
+// rank 0 is the most frequent
+class ZipfGenerator
+{
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+  double half_pow_theta;
+
+  static double zeta(uint64_t n, double theta)
+  {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+      sum += 1 / pow(double(i), theta);
+    return sum;
+  }
+
+ public:
+
+  ZipfGenerator(uint64_t n, double theta)
+    : n(n), theta(theta), alpha(1 / (1 - theta)), zetan(zeta(n, theta)),
+      half_pow_theta(pow(0.5, theta))
+  {
+    eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan);
+  }
+
+  uint64_t operator () (mt19937_64 &rng) const
+  {
+    const double u = uniform_real_distribution<double>()(rng);
+    const double uz = u * zetan;
+    if (uz < 1)
+      return 0;
+    if (uz < 1 + half_pow_theta)
+      return 1;
+    return std::min<uint64_t>(n - 1, n * pow(eta * u - eta + 1, alpha));
+  }
+};
+
+// the zeta of num_keys takes a while; so it is computed once
+const ZipfGenerator &zipf_generator()
+{
+  static const ZipfGenerator zipf(num_keys, zipf_theta);
+  return zipf;
+}
+
+// Stream of operations of a thread
+class OperationStream
+{
+  KeyPattern pattern;
+  double write_fraction;
+  double miss_fraction;
+  mt19937_64 rng;
+  uniform_real_distribution<double> coin;
+  const ZipfGenerator &zipf = zipf_generator();
+
+  uint64_t num_ops = 0;
+  uint64_t next_miss_key;
+  uint64_t scan_key = 0;
+  uint64_t scan_left = 0;
+  size_t trace_pos = 0;
+
+  uint64_t draw_key()
+  {
+    switch (pattern)
+      {
+      case KeyPattern::zipf:
+        return zipf(rng);
+
+      case KeyPattern::scan:
+        if (scan_left == 0 and coin(rng) < scan_probability)
+          {
+            scan_left = scan_length;
+            scan_key = scan_keys_base + (rng() >> 24) * scan_length;
+          }
+        if (scan_left > 0)
+          {
+            --scan_left;
+            return scan_key++;
+          }
+        return zipf(rng);
+
+      case KeyPattern::hotspot:
+        {
+          const uint64_t hot_size = num_keys * hot_fraction;
+          const uint64_t hot_base = num_ops / hot_period * hot_size;
+          if (coin(rng) < hot_probability)
+            return (hot_base + rng() % hot_size) % num_keys;
+          return rng() % num_keys;
+        }
+
+      default:
+        return 0;
+      }
+  }
+
+ public:
+
+  // the threads of a run draw different streams; they replay the trace
+  // from evenly spaced positions
+  OperationStream(KeyPattern pattern, int write_pct, int miss_pct,
+                  int thread_index, int num_threads)
+    : pattern(pattern), write_fraction(write_pct / 100.0),
+      miss_fraction(miss_pct / 100.0), rng(thread_index + 1),
+      next_miss_key(miss_keys_base + (uint64_t(thread_index) << 32))
+  {
+    if (pattern == KeyPattern::trace)
+      trace_pos = trace.size() / num_threads * thread_index;
+  }
+
+  Operation next()
+  {
+    ++num_ops;
+    if (pattern == KeyPattern::trace)
+      {
+        const Operation &op = trace[trace_pos];
+        if (++trace_pos == trace.size())
+          trace_pos = 0;
+        return op;
+      }
+
+    if (write_fraction > 0 and coin(rng) < write_fraction)
+      return { draw_key(), true };
+
+    if (miss_fraction > 0 and coin(rng) < miss_fraction)
+      return { next_miss_key++, false };
+
+    return { draw_key(), false };
+  }
+};
+
+bool miss_handler(const uint64_t &key, uint64_t *data, int8_t &, void *)
+{
+  const auto end = steady_clock::now() + miss_cost;
+  while (steady_clock::now() < end)
+    ; // a backend call
+  *data = key;
+  return true;
+}
+
+using LruCache = Cache<uint64_t, uint64_t>;
+using ClockCache = Cache<uint64_t, uint64_t, equal_to<uint64_t>, ClockPolicy>;
+using TinyLfuCache = Cache<uint64_t, uint64_t, equal_to<uint64_t>, TinyLfuPolicy>;
+using ShardedLruCache = ShardedCache<uint64_t, uint64_t>;
+
+template <class CacheType>
+unique_ptr<CacheType> make_cache(size_t capacity)
+{
+  return make_unique<CacheType>(capacity, 3600s, 3600s, miss_handler);
+}
+
+template <class CacheType>
+void run_operation(CacheType &cache, const Operation &op)
+{
+  if (op.write)
+    {
+      cache.remove(op.key);
+      cache.insert(uint64_t(op.key), uint64_t(op.key));
+    }
+  else
+    benchmark::DoNotOptimize(cache.retrieve_from_cache_or_compute(op.key));
+}
+
+// State of a run, shared by its threads. It is built by setup() before
+// the threads start and destroyed by teardown() after they finish
+template <class CacheType>
+struct Run
+{
+  static inline unique_ptr<CacheType> cache;
+
+  static inline mutex mtx;
+  static inline vector<int64_t> latencies; // ns, of all the threads
+  static inline int num_finished = 0;
+};
+
+template <class CacheType, KeyPattern pattern>
+void setup(const benchmark::State &)
+{
+  using R = Run<CacheType>;
+
+  const size_t capacity =
+    pattern == KeyPattern::trace ? trace_capacity : dft_capacity;
+  R::cache = make_cache<CacheType>(capacity);
+  R::latencies.clear();
+  R::num_finished = 0;
+
+  // the reads of the warm up fill the cache as the workload does
+  OperationStream warm_up(pattern, 0, 0, 0, 1);
+  for (size_t i = 0; i < 2 * capacity; ++i)
+    {
+      Operation op = warm_up.next();
+      op.write = false;
+      run_operation(*R::cache, op);
+    }
+  R::cache->reset_stats();
+}
+
+template <class CacheType, KeyPattern pattern>
+void teardown(const benchmark::State &)
+{
+  Run<CacheType>::cache.reset();
+}
+
+nanoseconds percentile(const vector<int64_t> &sorted, double p)
+{
+  if (sorted.empty())
+    return nanoseconds::zero();
+  return nanoseconds(sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))]);
+}
+
+// Arguments: write_pct, miss_pct
+template <class CacheType, KeyPattern pattern>
+void BM_cache(benchmark::State &state)
+{
+  using R = Run<CacheType>;
+
+  CacheType &cache = *R::cache;
+  OperationStream stream(pattern, state.range(0), state.range(1),
+                         state.thread_index(), state.threads());
+  vector<int64_t> latencies;
+
+  uint64_t i = 0;
+  for (auto _: state)
+    {
+      const Operation op = stream.next();
+      if (++i % sample_period != 0)
+        {
+          run_operation(cache, op);
+          continue;
+        }
+
+      const auto start = steady_clock::now();
+      run_operation(cache, op);
+      latencies.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    }
+  state.SetItemsProcessed(state.iterations());
+
+  // the counters of the threads are added up; so the last one that
+  // finishes reports the figures of the whole run
+  lock_guard lock(R::mtx);
+  R::latencies.insert(R::latencies.end(), latencies.begin(), latencies.end());
+  if (++R::num_finished < state.threads())
+    return;
+
+  sort(R::latencies.begin(), R::latencies.end());
+  state.counters["p50_ns"] = percentile(R::latencies, 0.5).count();
+  state.counters["p99_ns"] = percentile(R::latencies, 0.99).count();
+  state.counters["p999_ns"] = percentile(R::latencies, 0.999).count();
+  state.counters["hit_ratio"] = cache.stats().hit_ratio();
+}
+
+const int max_threads = std::max(1u, thread::hardware_concurrency());
+
+template <class CacheType, KeyPattern pattern>
+benchmark::internal::Benchmark *configure(benchmark::internal::Benchmark *b,
+                                          vector<int64_t> write_pcts,
+                                          vector<int64_t> miss_pcts)
+{
+  return b->Setup(setup<CacheType, pattern>)
+    ->Teardown(teardown<CacheType, pattern>)
+    ->ArgsProduct({ write_pcts, miss_pcts })
+    ->ArgNames({ "write_pct", "miss_pct" })
+    ->ThreadRange(1, max_threads)
+    ->UseRealTime();
+}
+
+# define CACHE_BENCHMARK(name, CacheType, pattern, write_pcts, miss_pcts) \
+  static auto *name##_registration =                                      \
+    configure<CacheType, pattern>(benchmark::RegisterBenchmark(           \
+      #name, BM_cache<CacheType, pattern>), write_pcts, miss_pcts)
+
+// the mixes on the default cache
+CACHE_BENCHMARK(zipf, LruCache, KeyPattern::zipf,
+                vector<int64_t>({ 0, 10 }), vector<int64_t>({ 0, 5 }));
+CACHE_BENCHMARK(scan, LruCache, KeyPattern::scan,
+                vector<int64_t>({ 0, 10 }), vector<int64_t>({ 0, 5 }));
+CACHE_BENCHMARK(hotspot, LruCache, KeyPattern::hotspot,
+                vector<int64_t>({ 0, 10 }), vector<int64_t>({ 0, 5 }));
+
+// the eviction policies and the sharding on the read only workloads
+CACHE_BENCHMARK(zipf_clock, ClockCache, KeyPattern::zipf,
+                vector<int64_t>({ 0 }), vector<int64_t>({ 0 }));
+CACHE_BENCHMARK(zipf_tinylfu, TinyLfuCache, KeyPattern::zipf,
+                vector<int64_t>({ 0 }), vector<int64_t>({ 0 }));
+CACHE_BENCHMARK(zipf_sharded, ShardedLruCache, KeyPattern::zipf,
+                vector<int64_t>({ 0 }), vector<int64_t>({ 0 }));
+CACHE_BENCHMARK(scan_tinylfu, TinyLfuCache, KeyPattern::scan,
+                vector<int64_t>({ 0 }), vector<int64_t>({ 0 }));
+
+int main(int argc, char **argv)
+{
+  // our flags are taken out before Google Benchmark parses the other ones
+  const string trace_flag = "--trace=";
+  const string capacity_flag = "--trace_capacity=";
+  int num_args = 0;
+  for (int i = 0; i < argc; ++i)
+    {
+      const string arg = argv[i];
+      if (arg.starts_with(trace_flag))
+        trace = load_trace(arg.substr(trace_flag.size()));
+      else if (arg.starts_with(capacity_flag))
+        trace_capacity = stoull(arg.substr(capacity_flag.size()));
+      else
+        argv[num_args++] = argv[i];
+    }
+  argc = num_args;
+
+  if (not trace.empty())
+    {
+      configure<LruCache, KeyPattern::trace>(benchmark::RegisterBenchmark(
+        "trace", BM_cache<LruCache, KeyPattern::trace>), { 0 }, { 0 });
+      configure<TinyLfuCache, KeyPattern::trace>(benchmark::RegisterBenchmark(
+        "trace_tinylfu", BM_cache<TinyLfuCache, KeyPattern::trace>), { 0 }, { 0 });
+    }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
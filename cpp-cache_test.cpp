@@ -7,13 +7,21 @@
 # include <gtest/gtest.h>
 # include <future>
 # include <thread>
+# include <numeric>
+# include <random>
+# include <set>
 # include "cpp-cache.H"
+# include "sharded-cache.H"
 
 # include <tpl_dynMapTree.H>
 
 using namespace std;
 using namespace testing;
 
+// The cache clock is coarse (see CoarseClock); so an expiration can be
+// observed up to a scheduler tick after the ttl
+constexpr auto clock_slack = 10ms;
+
 TEST(cache_entry, basic)
 {
   using Cache = Cache<int, int>;
@@ -37,14 +45,14 @@ TEST(cache_entry, basic)
 
   ASSERT_EQ(cache_entry.ad_hoc_code(), 1);
 
-  cache_entry.set_ttl_exp_time(high_resolution_clock::now() + 1s);
+  cache_entry.set_ttl_exp_time(Cache::Clock::now() + 1s);
 
-  ASSERT_FALSE(cache_entry.has_ttl_expired(high_resolution_clock::now()));
+  ASSERT_FALSE(cache_entry.has_ttl_expired(Cache::Clock::now()));
 
   // sleep for 1 second
   std::this_thread::sleep_for(std::chrono::seconds(1));
 
-  ASSERT_TRUE(cache_entry.has_ttl_expired(high_resolution_clock::now()));
+  ASSERT_TRUE(cache_entry.has_ttl_expired(Cache::Clock::now()));
 
   cout << "CacheEntry: " << cache_entry.get_data() << endl;
 }
@@ -94,6 +102,12 @@ TEST(cache_entry, data_move_works)
   ASSERT_TRUE(data.empty());
 }
 
+TEST(cache_entry, has_no_mutex)
+{
+  // key, data, lru link, status, codes, pins, position, hash and ttl
+  ASSERT_LE(sizeof(Cache<int, int>::CacheEntry), 56);
+}
+
 ///template <typename ... Args>
 struct SimpleFixture : public Test
 {
@@ -135,7 +149,7 @@ TEST_F(SimpleFixture, basic)
   ASSERT_TRUE(cache.has(1));
 
   // wait ttl to expire
-  sleep(1);
+  this_thread::sleep_for(1s + clock_slack);
 
   // key is not in cache
   ASSERT_FALSE(cache.has(1));
@@ -180,7 +194,7 @@ TEST_F(SimpleFixture, insert_with_has_and_touch)
     ASSERT_EQ(p_mru.second, 10);
 
     // test positive key expiration
-    sleep(1);
+    this_thread::sleep_for(1s + clock_slack);
     ASSERT_FALSE(cache.has(1))
               << "It should not be able to find the key, since it has expired";
   }
@@ -312,7 +326,7 @@ TEST_F(SimpleFixture, retrieve_or_compute_expired)
   ASSERT_EQ(res.second, 1);
 
   // wait ttl to expire
-  sleep(1);
+  this_thread::sleep_for(1s + clock_slack);
 
   res = cache.retrieve_from_cache_or_compute(1);
 
@@ -359,6 +373,314 @@ TEST_F(SimpleFixture, iterator)
   ASSERT_EQ(*it.get_curr().second, kv->second);
 }
 
+TEST_F(SimpleFixture, pinned_entries_are_not_evicted)
+{
+  for (int i = 1; i <= 5; ++i)
+    cache.insert(std::move(i), i * 10);
+
+  auto *lru_entry = cache.get_lru_entry();
+  ASSERT_EQ(lru_entry->key(), 1);
+  lru_entry->pin();
+
+  cache.insert(6, 60);
+
+  ASSERT_EQ(cache.size(), 5);
+  ASSERT_TRUE(cache.has(1));
+  ASSERT_FALSE(cache.has(2));
+
+  cache.unpin(lru_entry);
+  cache.insert(7, 70);
+
+  ASSERT_EQ(cache.size(), 5);
+  ASSERT_FALSE(cache.has(1));
+}
+
+TEST_F(SimpleFixture, overflow_when_all_entries_are_pinned)
+{
+  using CacheEntry = Cache<int, int>::CacheEntry;
+
+  vector<CacheEntry *> entries;
+  auto insert_pinned = [this, &entries](int i)
+  {
+    cache.insert(std::move(i), i * 10);
+    entries.push_back(cache.search_entry(i));
+    entries.back()->pin();
+  };
+
+  for (int i = 1; i <= 5; ++i)
+    insert_pinned(i);
+
+  ASSERT_EQ(cache.max_size(), 7);
+
+  // no victim ==> the cache overflows
+  insert_pinned(6);
+  insert_pinned(7);
+  ASSERT_EQ(cache.size(), 7);
+
+  // the cache is at its maximum size; so the insertion must wait until
+  // some entry is unpinned
+  auto future = std::async(std::launch::async, [this]()
+  {
+    return cache.insert(8, 80);
+  });
+
+  ASSERT_EQ(future.wait_for(200ms), future_status::timeout);
+  ASSERT_EQ(cache.size(), 7);
+
+  cache.unpin(entries[0]);
+  ASSERT_NE(future.get(), nullptr);
+  ASSERT_TRUE(cache.has(8));
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_EQ(cache.size(), 7);
+
+  // once released, the cache shrinks back to its capacity
+  for (size_t i = 1; i < entries.size(); ++i)
+    cache.unpin(entries[i]);
+
+  cache.insert(9, 90);
+  ASSERT_EQ(cache.size(), 5);
+}
+
+TEST_F(SimpleFixture, remove_pinned_entry_invalidates_it)
+{
+  using CacheEntry = Cache<int, int>::CacheEntry;
+
+  cache.retrieve_from_cache_or_compute(1);
+  CacheEntry *cache_entry = cache.search_entry(1);
+  cache_entry->pin();
+  *cache_entry->data_ptr() = 11;
+
+  cache.remove(1);
+
+  ASSERT_EQ(cache.size(), 1);
+  ASSERT_FALSE(cache.has(1));
+
+  cache.unpin(cache_entry);
+
+  auto [data, ad_hoc_code] = cache.retrieve_from_cache_or_compute(1);
+  ASSERT_EQ(*data, 10); // recomputed
+  ASSERT_EQ(ad_hoc_code, 1);
+  ASSERT_TRUE(cache.has(1));
+
+  cache.remove(1);
+  ASSERT_EQ(cache.size(), 0);
+}
+
+TEST_F(SimpleFixture, entries_are_reused_from_the_arena)
+{
+  vector<int *> data_ptrs;
+  for (int i = 1; i <= 5; ++i)
+    data_ptrs.push_back(cache.insert(std::move(i), i * 10));
+
+  // the data does not move while the entry is in the cache
+  for (int i = 1; i <= 5; ++i)
+    ASSERT_EQ(cache.retrieve_from_cache_or_compute(i).first, data_ptrs[i - 1]);
+
+  // the lru entry (1) is evicted and its arena position is reused
+  int *data = cache.insert(6, 60);
+  ASSERT_EQ(data, data_ptrs[0]);
+  ASSERT_EQ(*data, 60);
+  ASSERT_EQ(cache.search_entry(1), nullptr);
+  ASSERT_EQ(cache.search_entry(6)->data_ptr(), data);
+
+  cache.remove(3);
+  ASSERT_EQ(cache.size(), 4);
+  ASSERT_EQ(cache.insert(7, 70), data_ptrs[2]);
+
+  for (auto it = cache.get_it(); it.has_curr(); it.next())
+    ASSERT_EQ(*it.get_curr().second, it.get_curr().first * 10);
+}
+
+TEST_F(SimpleFixture, handle_pins_the_entry)
+{
+  auto handle = cache.retrieve_handle(1);
+  ASSERT_TRUE(handle);
+  ASSERT_EQ(handle.key(), 1);
+  ASSERT_EQ(*handle, 10);
+  ASSERT_EQ(handle.ad_hoc_code(), 1);
+
+  const int *data = &*handle;
+  for (int i = 2; i <= 10; ++i)
+    cache.insert(std::move(i), i * 10);
+
+  // the lru pair was not evicted and its data did not move
+  ASSERT_TRUE(cache.has(1));
+  ASSERT_EQ(cache.retrieve_from_cache_or_compute(1).first, data);
+
+  auto lru = cache.get_lru_handle();
+  ASSERT_TRUE(lru);
+  ASSERT_EQ(*lru, lru.key() * 10);
+
+  Cache<int, int>::Handle moved = std::move(handle);
+  ASSERT_FALSE(handle);
+  ASSERT_EQ(&*moved, data);
+
+  moved.release();
+  lru.release();
+  for (int i = 11; i <= 15; ++i)
+    cache.insert(std::move(i), i * 10);
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_EQ(cache.size(), 5);
+}
+
+TEST_F(SimpleFixture, expired_entry_is_replaced_while_a_handle_holds_it)
+{
+  auto old_handle = cache.retrieve_handle(1);
+  *cache.search_entry(1)->data_ptr() = 11;
+
+  cache.remove(1); // pinned ==> invalidated
+  ASSERT_FALSE(cache.has(1));
+
+  // the data of old_handle is not computed again in place
+  auto new_handle = cache.retrieve_handle(1);
+  ASSERT_EQ(*new_handle, 10);
+  ASSERT_EQ(*old_handle, 11);
+  ASSERT_NE(&*old_handle, &*new_handle);
+  ASSERT_EQ(cache.search_entry(1)->data_ptr(), &*new_handle);
+
+  // the detached entry returns to the arena with its last pin
+  ASSERT_EQ(cache.size(), 2);
+  const int *old_data = &*old_handle;
+  old_handle.release();
+  ASSERT_EQ(cache.size(), 1);
+  ASSERT_EQ(cache.insert(2, 20), old_data);
+
+  // without other pins, it is computed again in place
+  cache.remove(2);
+  new_handle.release();
+  cache.remove(1);
+  ASSERT_EQ(cache.size(), 0);
+}
+
+TEST(LinearIndex, removal_keeps_colliding_items_reachable)
+{
+  LinearIndex index(16, 1.3f);
+  ASSERT_EQ(index.num_slots(), 32);
+
+  // all the items have the same hash; so they are in the same probe sequence
+  for (uint32_t pos = 0; pos < 10; ++pos)
+    index.insert(7, pos);
+
+  auto find = [&index](uint32_t pos)
+  {
+    return index.find(7, [pos](uint32_t p) { return p == pos; });
+  };
+
+  ASSERT_TRUE(index.remove(7, 3));
+  ASSERT_TRUE(index.remove(7, 0));
+  ASSERT_FALSE(index.remove(7, 3));
+  ASSERT_EQ(index.size(), 8);
+
+  for (uint32_t pos = 0; pos < 10; ++pos)
+    ASSERT_EQ(find(pos), pos == 0 or pos == 3 ? LinearIndex::npos : pos);
+
+  size_t n = 0;
+  for (LinearIndex::Iterator it(index); it.has_curr(); it.next())
+    ++n;
+  ASSERT_EQ(n, 8);
+}
+
+TEST(SwissIndex, removal_keeps_colliding_items_reachable)
+{
+  SwissIndex index(64, 1.3f);
+  ASSERT_EQ(index.num_slots(), 128);
+
+  // 40 items with the same hash fill the first groups of the probe sequence
+  for (uint32_t pos = 0; pos < 40; ++pos)
+    index.insert(7, pos);
+
+  auto find = [&index](uint32_t pos)
+  {
+    return index.find(7, [pos](uint32_t p) { return p == pos; });
+  };
+
+  for (uint32_t pos = 0; pos < 40; pos += 3)
+    ASSERT_TRUE(index.remove(7, pos));
+  ASSERT_FALSE(index.remove(7, 0));
+
+  for (uint32_t pos = 0; pos < 40; ++pos)
+    ASSERT_EQ(find(pos), pos % 3 == 0 ? SwissIndex::npos : pos);
+
+  // churn enough for consuming the empty slots, so that the table is rebuilt
+  for (uint32_t pos = 40; pos < 2000; ++pos)
+    {
+      index.insert(pos, pos);
+      ASSERT_TRUE(index.remove(pos, pos));
+    }
+
+  for (uint32_t pos = 0; pos < 40; ++pos)
+    ASSERT_EQ(find(pos), pos % 3 == 0 ? SwissIndex::npos : pos);
+
+  size_t n = 0;
+  for (SwissIndex::Iterator it(index); it.has_curr(); it.next())
+    ++n;
+  ASSERT_EQ(n, index.size());
+  ASSERT_EQ(n, 26);
+}
+
+TEST(SwissIndex, cache)
+{
+  Cache<int, int, std::equal_to<int>, LruPolicy, SwissIndex>
+    cache(100, 10s, 10s, SimpleFixture::miss_handler);
+
+  for (int round = 0; round < 3; ++round)
+    for (int i = 0; i < 1000; ++i)
+      {
+        auto [data, ad_hoc_code] = cache.retrieve_from_cache_or_compute(i);
+        ASSERT_EQ(*data, i * 10);
+        ASSERT_LE(cache.size(), cache.capacity());
+      }
+
+  for (int i = 900; i < 1000; ++i)
+    ASSERT_TRUE(cache.has(i));
+  ASSERT_FALSE(cache.has(899));
+}
+
+// Average time, in nanoseconds, of a successful and an unsuccessful
+// find() on an index loaded at 1 / Cache::ratio
+template <class Index>
+pair<double, double> probe_cost(size_t num_items, size_t num_finds)
+{
+  Index index(num_items, Cache<int, int>::ratio);
+  for (uint32_t pos = 0; pos < num_items; ++pos)
+    index.insert(pos, pos);
+
+  auto time_finds = [&index, num_items, num_finds](size_t first_key)
+  {
+    size_t found = 0;
+    auto start = high_resolution_clock::now();
+    for (size_t i = 0; i < num_finds; ++i)
+      {
+        const size_t key = first_key + (i * 7919) % num_items;
+        found += index.find(key, [key](uint32_t pos) { return pos == key; })
+                 != Index::npos;
+      }
+    auto elapsed = duration_cast<nanoseconds>(high_resolution_clock::now() - start);
+    return make_pair(double(elapsed.count()) / num_finds, found);
+  };
+
+  auto [hit_cost, hits] = time_finds(0);
+  auto [miss_cost, false_hits] = time_finds(num_items);
+  EXPECT_EQ(hits, num_finds);
+  EXPECT_EQ(false_hits, 0);
+
+  return {hit_cost, miss_cost};
+}
+
+TEST(IndexProbeCost, swiss_vs_linear)
+{
+  constexpr size_t num_items = 1 << 20;
+  constexpr size_t num_finds = 4 * num_items;
+
+  auto [linear_hit, linear_miss] = probe_cost<LinearIndex>(num_items, num_finds);
+  auto [swiss_hit, swiss_miss] = probe_cost<SwissIndex>(num_items, num_finds);
+
+  cout << "LinearIndex: hit " << linear_hit << " ns, miss " << linear_miss
+       << " ns" << endl
+       << "SwissIndex:  hit " << swiss_hit << " ns, miss " << swiss_miss
+       << " ns" << endl;
+}
+
 struct TimeConsumingFixture : public Test
 {
   static bool miss_handler(const int &key, int *data,
@@ -388,7 +710,7 @@ TEST_F(TimeConsumingFixture, calculating_status_while_computing)
     std::async(std::launch::async, [this, &cache_entry]()
     {
       return cache.resolve_cache_miss(cache_entry,
-                                      high_resolution_clock::now(), nullptr);
+                                      Cache<int, int>::Clock::now(), nullptr);
     });
 
   // wait 1 s
@@ -401,13 +723,35 @@ TEST_F(TimeConsumingFixture, calculating_status_while_computing)
 
   cout << CacheEntry::status_to_string(cache_entry->status()) << endl;
   ASSERT_EQ(cache_entry->status(), CacheEntry::Status::READY);
-  ASSERT_FALSE(cache_entry->has_ttl_expired(high_resolution_clock::now()));
+  ASSERT_FALSE(cache_entry->has_ttl_expired(Cache<int, int>::Clock::now()));
 
   ASSERT_EQ(*res, 10);
   ASSERT_EQ(cache_entry->ad_hoc_code(), 1);
   ASSERT_EQ(cache_entry->get_data(), 10);
 }
 
+TEST_F(TimeConsumingFixture, waiting_does_not_block_other_operations)
+{
+  auto future = std::async(std::launch::async, [this]()
+  {
+    return cache.retrieve_from_cache_or_compute(1);
+  });
+
+  sleep(1);
+
+  // the key is being computed: has() does not wait for it and insert()
+  // does not overwrite it
+  auto start = high_resolution_clock::now();
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_EQ(cache.insert(1, 99), nullptr);
+  ASSERT_LT(high_resolution_clock::now() - start, 500ms);
+
+  auto res = future.get();
+  ASSERT_EQ(*res.first, 10);
+  ASSERT_EQ(res.second, 1);
+  ASSERT_TRUE(cache.has(1));
+}
+
 TEST_F(TimeConsumingFixture, two_threads)
 {
   auto future1 = std::async(std::launch::async, [this]()
@@ -562,192 +906,2206 @@ TEST_F(TimeConsumingFixture, multithread_heavy_threads)
     }
 }
 
-struct RandomTimeFixture : public Test
+TEST_F(TimeConsumingFixture, multithread_more_keys_than_capacity)
 {
-  static bool miss_handler(const int &key, int *data,
-                           int8_t &ad_hoc_code, void *)
-  {
-    *data = key * 10;
-    ++ad_hoc_code; // never must be greater than 1
+  // 10 keys computed at the same time in a cache of 5 entries: the
+  // entries being computed cannot be evicted, so the cache overflows and
+  // the excess waits until some computation finishes. Once returned, the
+  // entries can be replaced; so the data is not checked here
+  constexpr int N = 3;
+  vector<future<pair<int *, int8_t>>> futures;
 
-    // sleep for a random time between 0.5 s and 9.5 s
-    this_thread::sleep_for(chrono::milliseconds(500) +
-                           chrono::milliseconds(rand() % 9000));
+  for (int i = 1; i <= 10; ++i)
+    for (int j = 0; j < N; ++j)
+      futures.push_back(std::async(std::launch::async, [this, i]()
+      {
+        return cache.retrieve_from_cache_or_compute(i);
+      }));
 
-    return true;
-  }
+  for (int i = 0; i < 10 * N; ++i)
+    {
+      auto res = futures[i].get();
+      ASSERT_NE(res.first, nullptr);
+      ASSERT_EQ(res.second, 1);
+    }
+
+  ASSERT_LE(cache.size(), cache.max_size());
+}
+
+struct AsyncFixture : public Test
+{
+  atomic<int> num_calls = 0;
+
+  vector<thread> workers; // where the computations are done
 
   Cache<int, int> cache;
 
-  RandomTimeFixture()
-    : cache(1019, 10s, 1s, miss_handler)
+  AsyncFixture()
+    : cache(5, 20s, 20s, SimpleFixture::miss_handler)
   {
-    // empty
+    cache.async_miss_handler = [this](const int &key, int *data,
+                                      int8_t &ad_hoc_code, void *,
+                                      Cache<int, int>::MissCompletion done)
+    {
+      ++num_calls;
+      workers.emplace_back([key, data, &ad_hoc_code, done]()
+      {
+        sleep(1);
+        *data = key * 10;
+        ad_hoc_code = key % 2 == 0 ? 1 : -1;
+        done(key % 2 == 0);
+      });
+    };
+  }
+
+  ~AsyncFixture()
+  {
+    for (auto &worker: workers)
+      worker.join();
   }
 };
 
-TEST_F(RandomTimeFixture, random_miss_handler)
+TEST_F(AsyncFixture, single_flight_without_blocking)
 {
-  constexpr int N = 30;
+  auto start = high_resolution_clock::now();
+
   vector<future<pair<int *, int8_t>>> futures;
+  for (int i = 0; i < 10; ++i)
+    futures.push_back(cache.retrieve_async(2));
 
-  for (int i = 1; i <= 5; ++i)
+  ASSERT_LT(high_resolution_clock::now() - start, 500ms);
+  ASSERT_EQ(futures[0].wait_for(0s), future_status::timeout);
+
+  auto [data, code] = futures[0].get();
+  ASSERT_EQ(*data, 20);
+  for (size_t i = 1; i < futures.size(); ++i)
     {
-      for (int j = 0; j < N; ++j)
-        {
-          futures.push_back(std::async(std::launch::async, [this, i]()
-          {
-            return cache.retrieve_from_cache_or_compute(i);
-          }));
-        }
+      auto [ptr, ad_hoc_code] = futures[i].get();
+      ASSERT_EQ(ptr, data);
+      ASSERT_EQ(ad_hoc_code, 1);
     }
+  ASSERT_EQ(num_calls, 1);
 
-  vector<pair<int *, int8_t>> results;
-  for (int i = 0; i < N * 5; ++i)
-    results.push_back(futures[i].get());
+  // now it is a hit
+  auto res = cache.retrieve_async(2);
+  ASSERT_EQ(res.wait_for(0s), future_status::ready);
+  ASSERT_EQ(res.get().first, data);
+  ASSERT_EQ(num_calls, 1);
+}
 
-  ASSERT_EQ(cache.size(), 5);
+TEST_F(AsyncFixture, sync_retrieve_waits_for_async_computation)
+{
+  auto async_res = cache.retrieve_async(3);
 
-  for (int i = 1; i <= 5; ++i)
-    ASSERT_TRUE(cache.has(i));
+  auto [data, ad_hoc_code] = cache.retrieve_from_cache_or_compute(3);
+  ASSERT_EQ(*data, 30);
+  ASSERT_EQ(ad_hoc_code, -1); // failed; so negatively cached
+  ASSERT_EQ(async_res.get().first, data);
+  ASSERT_EQ(num_calls, 1);
+  ASSERT_TRUE(cache.has(3));
+}
 
-  for (int i = 0; i < N * 5; i += N)
-    {
-      auto res_i = results[i];
-      for (int j = 1; j < N; ++j)
-        {
-          auto res_j = results[i + j];
-          ASSERT_EQ(res_i.first, res_j.first); // same address
-          ASSERT_EQ(res_i.second, res_j.second);
-        }
-    }
+TEST_F(AsyncFixture, without_async_handler_computes_in_the_caller)
+{
+  cache.async_miss_handler = nullptr;
+
+  auto res = cache.retrieve_async(4);
+  ASSERT_EQ(res.wait_for(0s), future_status::ready);
+
+  auto [data, ad_hoc_code] = res.get();
+  ASSERT_EQ(*data, 40);
+  ASSERT_EQ(ad_hoc_code, 1);
+  ASSERT_EQ(num_calls, 0);
 }
 
-struct ComplexKey : public Test
+struct BatchFixture : public Test
 {
-  using Tree = DynSetTree<int>;
+  using CacheType = Cache<int, int>;
 
-  template <typename ... Args>
-  Tree create_key(Args ... args)
+  vector<size_t> batch_sizes; // of every call to the batch handler
+
+  static void batch_handler(vector<size_t> &batch_sizes,
+                            span<CacheType::MissRequest> requests)
   {
-    Tree key;
-    (key.insert(args), ...);
-    return key;
+    batch_sizes.push_back(requests.size());
+    for (auto &request: requests)
+      {
+        *request.data = request.key * 10;
+        request.ad_hoc_code = 1;
+        request.success = request.key >= 0;
+      }
   }
 
-  static size_t hash_fct(const Tree &tree)
+  CacheType cache;
+
+  BatchFixture()
+    : cache(100, 10s, 10s, SimpleFixture::miss_handler)
   {
-    return tree.foldl<size_t>(0, [](size_t acc, int i)
+    cache.batch_miss_handler = [this](span<CacheType::MissRequest> requests,
+                                      void *)
     {
-      return acc ^ SuperFastHash(i);
-    });
+      batch_handler(batch_sizes, requests);
+    };
   }
+};
 
-  static bool miss_handler(const Tree &tree, int *data,
-                           int8_t &ad_hoc_code, void *)
-  {
-    *data = tree.foldl<int>(0, [](int acc, int i)
-    {
-      return acc + i;
-    });
-    ++ad_hoc_code; // never must be greater than 1
+TEST_F(BatchFixture, misses_are_resolved_in_a_single_call)
+{
+  for (int i = 0; i < 20; ++i)
+    cache.retrieve_from_cache_or_compute(i);
 
-    return true;
-  }
+  vector<int> keys;
+  for (int i = 0; i < 50; ++i)
+    keys.push_back(i);
+  keys.push_back(-1);
+  keys.push_back(30); // repeated
 
-  Cache<Tree, int> cache = Cache<Tree, int>(3, 2s, 1s,
-                                            miss_handler,
-                                            hash_fct);
+  auto results = cache.retrieve_many(keys);
 
-};
+  ASSERT_EQ(batch_sizes, vector<size_t>({31}));
+  ASSERT_EQ(results.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+    {
+      ASSERT_EQ(*results[i].first, keys[i] * 10);
+      ASSERT_EQ(results[i].second, 1);
+    }
+  ASSERT_EQ(results[30].first, results.back().first);
 
-TEST_F(ComplexKey, key_creation)
+  // all hits now; the failed key is negatively cached
+  results = cache.retrieve_many(keys);
+  ASSERT_EQ(batch_sizes.size(), 1);
+  ASSERT_EQ(cache.size(), 51);
+}
+
+TEST_F(BatchFixture, keys_referred_by_pointers)
 {
-  // a key with just a node
-  auto tree_1 = create_key(1);
-  ASSERT_EQ(tree_1.size(), 1);
-  ASSERT_TRUE(tree_1.contains(1));
+  vector<int> keys = { 3, 1, 4, 1, 5 };
+  vector<const int *> subset = { &keys[4], &keys[0], &keys[3] };
 
-  // a key with 3 nodes
-  auto tree_2 = create_key(1, 2, 3);
-  ASSERT_EQ(tree_2.size(), 3);
-  ASSERT_TRUE(tree_2.contains(1));
-  ASSERT_TRUE(tree_2.contains(2));
-  ASSERT_TRUE(tree_2.contains(3));
+  auto results = cache.retrieve_many(span<const int * const>(subset));
+
+  ASSERT_EQ(batch_sizes, vector<size_t>({3}));
+  for (size_t i = 0; i < subset.size(); ++i)
+    ASSERT_EQ(*results[i].first, *subset[i] * 10);
+  ASSERT_EQ(results, cache.retrieve_many(span<const int * const>(subset)));
 }
 
-TEST_F(ComplexKey, hash_fct)
+TEST_F(BatchFixture, batch_bigger_than_the_cache)
 {
-  auto tree_1 = create_key(1);
-  auto tree_2 = create_key(11, 20, 30);
+  Cache<int, int> small(5, 10s, 10s, SimpleFixture::miss_handler);
 
-  cout << "Hash tree_1: " << hash_fct(tree_1) << endl
-       << "Hash tree_2: " << hash_fct(tree_2) << endl;
+  vector<int> keys;
+  for (int i = 0; i < 20; ++i)
+    keys.push_back(i);
 
-  ASSERT_EQ(hash_fct(tree_1), hash_fct(tree_1));
-  ASSERT_EQ(hash_fct(tree_2), hash_fct(tree_2));
-  ASSERT_NE(hash_fct(tree_1), hash_fct(tree_2));
+  // without batch handler, miss_handler is called per key
+  auto results = small.retrieve_many(keys);
+  for (auto &[data, ad_hoc_code]: results)
+    {
+      ASSERT_NE(data, nullptr);
+      ASSERT_EQ(ad_hoc_code, 1);
+    }
+  ASSERT_LE(small.size(), small.max_size());
+
+  small.batch_miss_handler = [this](span<CacheType::MissRequest> requests,
+                                    void *)
+  {
+    batch_handler(batch_sizes, requests);
+  };
+
+  results = small.retrieve_many(keys);
+  ASSERT_GT(batch_sizes.size(), 1);
+  for (size_t n: batch_sizes)
+    ASSERT_LE(n, small.max_size());
 }
 
-TEST_F(ComplexKey, cache)
+TEST(ShardedBatch, one_call_per_shard)
 {
-  auto tree_1 = create_key(1);
-  auto tree_2 = create_key(11, 20, 30);
+  using CacheType = ShardedCache<int, int>;
 
-  auto [data_1, ad_hoc_code_1] = cache.retrieve_from_cache_or_compute(tree_1);
-  auto [data_2, ad_hoc_code_2] = cache.retrieve_from_cache_or_compute(tree_2);
+  CacheType cache(1000, 10s, 10s, SimpleFixture::miss_handler, 4);
+
+  atomic<int> num_calls = 0;
+  cache.set_batch_miss_handler([&num_calls](span<Cache<int, int>::MissRequest> requests,
+                                            void *)
+  {
+    ++num_calls;
+    for (auto &request: requests)
+      {
+        *request.data = request.key * 10;
+        request.success = true;
+      }
+  });
+
+  vector<int> keys(200);
+  std::iota(keys.begin(), keys.end(), 0);
+
+  auto results = cache.retrieve_many(keys);
+  ASSERT_LE(num_calls, 4);
+  for (size_t i = 0; i < keys.size(); ++i)
+    ASSERT_EQ(*results[i].first, keys[i] * 10);
+}
+
+// Performs ops_per_thread hits on num_keys already cached keys from each of
+// num_threads threads. Returns the throughput in operations per second
+template <class CacheType>
+double hits_throughput(CacheType &cache, int num_keys, int num_threads,
+                       int ops_per_thread)
+{
+  for (int i = 0; i < num_keys; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+
+  vector<thread> threads;
+  const auto start = steady_clock::now();
+  for (int t = 0; t < num_threads; ++t)
+    threads.emplace_back([&cache, num_keys, ops_per_thread, t]()
+                         {
+                           for (int i = 0; i < ops_per_thread; ++i)
+                             {
+                               const int key = (i * 7919 + t) % num_keys;
+                               auto res = cache.retrieve_from_cache_or_compute(key);
+                               ASSERT_EQ(*res.first, key * 10);
+                             }
+                         });
+  for (auto &t: threads)
+    t.join();
+
+  const duration<double> elapsed = steady_clock::now() - start;
+
+  return num_threads * ops_per_thread / elapsed.count();
+}
+
+struct ShardedFixture : public Test
+{
+  static bool miss_handler(const int &key, int *data,
+                           int8_t &ad_hoc_code, void *)
+  {
+    *data = key * 10;
+    ++ad_hoc_code; // never must be greater than 1
+    return true;
+  }
+
+  ShardedCache<int, int> cache;
+
+  ShardedFixture()
+    : cache(64, 1s, 1s, miss_handler, 4)
+  {
+    // empty
+  }
+};
+
+TEST_F(ShardedFixture, basic)
+{
+  ASSERT_EQ(cache.num_shards(), 4);
+  ASSERT_EQ(cache.capacity(), 64);
+  ASSERT_EQ(cache.size(), 0);
+
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_NE(cache.insert(1, 10), nullptr);
+  ASSERT_EQ(cache.insert(1, 11), nullptr) << "key 1 is already in the cache";
+  ASSERT_TRUE(cache.has(1));
+  ASSERT_TRUE(cache.touch(1));
+  ASSERT_EQ(cache.size(), 1);
 
+  auto [data, ad_hoc_code] = cache.retrieve_from_cache_or_compute(2);
+  ASSERT_EQ(*data, 20);
+  ASSERT_EQ(ad_hoc_code, 1);
   ASSERT_EQ(cache.size(), 2);
-  ASSERT_TRUE(cache.has(tree_1));
-  ASSERT_TRUE(cache.has(tree_2));
+  ASSERT_TRUE(cache.get_shard(2).has(2));
 
-  ASSERT_EQ(*data_1, 1);
-  ASSERT_EQ(*data_2, 61);
+  cache.remove(1);
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_EQ(cache.size(), 1);
 
-  ASSERT_EQ(ad_hoc_code_1, 1);
-  ASSERT_EQ(ad_hoc_code_2, 1);
+  // wait ttl to expire
+  this_thread::sleep_for(1s + clock_slack);
+  ASSERT_FALSE(cache.has(2));
 }
 
-struct CookieHandler : public Test
+TEST_F(ShardedFixture, size_never_exceeds_capacity)
 {
-  struct Parameters
+  for (int i = 0; i < 1000; ++i)
+    {
+      auto res = cache.retrieve_from_cache_or_compute(i);
+      ASSERT_EQ(*res.first, i * 10);
+      ASSERT_LE(cache.size(), cache.capacity());
+    }
+
+  for (size_t i = 0; i < cache.num_shards(); ++i)
+    ASSERT_EQ(cache.get_shard_by_index(i).size(),
+              cache.get_shard_by_index(i).capacity());
+}
+
+TEST(Handle, data_is_stable_while_pairs_are_replaced)
+{
+  static atomic<int> generation = 0;
+  auto miss_handler = [](const int &, vector<int> *data, int8_t &, void *)
   {
-    int a;
-    int b;
+    data->assign(64, ++generation);
+    return true;
+  };
+
+  using Cache = ShardedCache<int, vector<int>>;
+  Cache cache(32, 1s, 1s, miss_handler, 2);
+
+  // every reader keeps a handle while it takes the next one
+  atomic<bool> done = false;
+  atomic<size_t> num_torn = 0;
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t)
+    readers.emplace_back([&, t]()
+    {
+      Cache::Handle held;
+      vector<int> held_copy;
+      for (int i = 0; not done; ++i)
+        {
+          auto handle = cache.retrieve_handle((i * 5 + t) % 12);
+          if (held and *held != held_copy)
+            ++num_torn;
+          held_copy = *handle;
+          held = std::move(handle);
+          if (std::count(held_copy.begin(), held_copy.end(), held_copy[0]) != 64)
+            ++num_torn;
+          this_thread::yield();
+        }
+    });
+
+  // the removed pinned pairs are invalidated; so they are replaced
+  for (int i = 0; i < 2000; ++i)
+    {
+      cache.remove(i % 12);
+      this_thread::yield();
+    }
+
+  done = true;
+  for (auto &reader: readers)
+    reader.join();
+
+  ASSERT_EQ(num_torn, 0);
+  ASSERT_LE(cache.size(), 12);
+}
+
+TEST(ReadMostlyThroughput, deferred_vs_eager_mru)
+{
+  auto miss_handler = [](const int &key, int *data, int8_t &ad_hoc_code, void *)
+  {
+    *data = key * 10;
+    ++ad_hoc_code;
+    return true;
   };
 
+  constexpr int num_keys = 1024;
+  constexpr int ops_per_thread = 200000;
+  const int max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+      Cache<int, int> eager_cache(num_keys, 60s, 1s, miss_handler);
+      eager_cache.deferred_mru() = false; // every hit locks and relinks
+
+      Cache<int, int> deferred_cache(num_keys, 60s, 1s, miss_handler);
+
+      Cache<int, int, std::equal_to<int>, ClockPolicy>
+        clock_cache(num_keys, 60s, 1s, miss_handler);
+
+      const double eager = hits_throughput(eager_cache, num_keys, num_threads,
+                                           ops_per_thread);
+      const double deferred = hits_throughput(deferred_cache, num_keys,
+                                              num_threads, ops_per_thread);
+      const double clock = hits_throughput(clock_cache, num_keys, num_threads,
+                                           ops_per_thread);
+
+      cout << num_threads << " threads: eager mru " << size_t(eager)
+           << " hits/s, deferred mru " << size_t(deferred)
+           << " hits/s, clock " << size_t(clock) << " hits/s" << endl;
+
+      ASSERT_EQ(deferred_cache.size(), num_keys);
+    }
+}
+
+TEST_F(SimpleFixture, deferred_mru_is_applied_before_eviction)
+{
+  for (int i = 1; i <= 5; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+
+  // hits are only recorded; the lru order is updated later
+  cache.retrieve_from_cache_or_compute(1);
+  cache.retrieve_from_cache_or_compute(2);
+
+  ASSERT_EQ(cache.get_lru().first, 3);
+  ASSERT_EQ(cache.get_mru().first, 2);
+
+  cache.retrieve_from_cache_or_compute(3);
+  cache.retrieve_from_cache_or_compute(6); // evicts 4, not 1
+
+  ASSERT_TRUE(cache.has(1));
+  ASSERT_TRUE(cache.has(3));
+  ASSERT_FALSE(cache.has(4));
+  ASSERT_EQ(cache.size(), 5);
+}
+
+struct ClockFixture : public Test
+{
   static bool miss_handler(const int &key, int *data,
-                           int8_t &ad_hoc_code,
-                           void *cookie)
+                           int8_t &ad_hoc_code, void *)
   {
-    Parameters *params = static_cast<Parameters *>(cookie);
-    cout << "Params: " << params->a << " " << params->b << endl;
+    *data = key * 10;
+    ++ad_hoc_code; // never must be greater than 1
+    return true;
+  }
 
-    *data = params->a + params->b;
+  using ClockCache = Cache<int, int, std::equal_to<int>, ClockPolicy>;
+
+  ClockCache cache;
+
+  ClockFixture()
+    : cache(5, 10s, 1s, miss_handler)
+  {
+    // empty
+  }
+};
+
+TEST_F(ClockFixture, referenced_entries_get_a_second_chance)
+{
+  for (int i = 1; i <= 5; ++i)
+    ASSERT_NE(cache.insert(std::move(i), i * 10), nullptr);
+
+  ASSERT_EQ(cache.size(), 5);
+
+  // hits only set the reference bit
+  for (int i = 1; i <= 3; ++i)
+    ASSERT_EQ(*cache.retrieve_from_cache_or_compute(i).first, i * 10);
+
+  ASSERT_EQ(cache.get_lru().first, 4);
+
+  cache.retrieve_from_cache_or_compute(6); // 4 is the first unreferenced
+
+  ASSERT_EQ(cache.size(), 5);
+  ASSERT_FALSE(cache.has(4));
+  ASSERT_EQ(cache.get_mru().first, 6);
+
+  cache.retrieve_from_cache_or_compute(7); // 5 is after 4 in the clock
+
+  ASSERT_FALSE(cache.has(5));
+  for (int i: {1, 2, 3, 6, 7})
+    ASSERT_TRUE(cache.has(i));
+
+  cache.remove(2);
+  ASSERT_EQ(cache.size(), 4);
+  ASSERT_FALSE(cache.has(2));
+}
+
+TEST_F(ClockFixture, entry_is_smaller_than_with_lru)
+{
+  ASSERT_LT(sizeof(ClockCache::CacheEntry), sizeof(Cache<int, int>::CacheEntry));
+}
+
+TEST_F(ClockFixture, multithread_cache_full)
+{
+  constexpr int N = 8;
+  vector<future<pair<int *, int8_t>>> futures;
+
+  for (int i = 1; i <= 50; ++i)
+    for (int j = 0; j < N; ++j)
+      futures.push_back(std::async(std::launch::async, [this, i]()
+      {
+        return cache.retrieve_from_cache_or_compute(i % 7);
+      }));
+
+  for (auto &f: futures)
+    {
+      auto res = f.get();
+      ASSERT_EQ(res.second, 1);
+    }
+
+  ASSERT_EQ(cache.size(), 5);
+}
+
+TEST(FrequencySketch, counts_and_ages)
+{
+  FrequencySketch sketch(100);
+
+  ASSERT_EQ(sketch.frequency(42), 0);
+
+  sketch.increment(42); // only recorded in the doorkeeper
+  ASSERT_EQ(sketch.frequency(42), 1);
+
+  for (int i = 0; i < 5; ++i)
+    sketch.increment(42);
+  ASSERT_EQ(sketch.frequency(42), 6);
+
+  // 1000 increments (10 * capacity) age the sketch
+  for (int i = 0; i < 994; ++i)
+    sketch.increment(7);
+
+  ASSERT_GE(sketch.frequency(42), 2);
+  ASSERT_LE(sketch.frequency(42), 3);
+}
+
+TEST(TinyLfuPolicy, hot_keys_survive_a_scan)
+{
+  size_t num_misses = 0;
+  auto miss_handler = [&num_misses](const int &key, int *data,
+                                    int8_t &ad_hoc_code, void *)
+  {
+    ++num_misses;
+    *data = key * 10;
+    ++ad_hoc_code;
+    return true;
+  };
+
+  // returns the number of misses while the hot keys are accessed mixed
+  // with a long tail of one-hit wonders
+  auto scan_misses = [&num_misses](auto &cache)
+  {
+    for (int round = 0; round < 10; ++round) // hot keys
+      for (int key = 0; key < 50; ++key)
+        cache.retrieve_from_cache_or_compute(key);
+
+    num_misses = 0;
+    for (int i = 0; i < 2000; ++i)
+      {
+        cache.retrieve_from_cache_or_compute(1000 + i); // one-hit wonder
+        if (i % 2 == 0)
+          cache.retrieve_from_cache_or_compute(i / 2 % 50);
+      }
+
+    return num_misses - 2000;
+  };
+
+  Cache<int, int> lru_cache(100, 60s, 1s, miss_handler);
+  Cache<int, int, std::equal_to<int>, TinyLfuPolicy>
+    tinylfu_cache(100, 60s, 1s, miss_handler);
+
+  const size_t lru_misses = scan_misses(lru_cache);
+  const size_t tinylfu_misses = scan_misses(tinylfu_cache);
+
+  cout << "misses on 1000 hot key accesses: lru " << lru_misses
+       << ", w-tinylfu " << tinylfu_misses << endl;
+
+  ASSERT_GE(lru_misses, 900);
+  ASSERT_LE(tinylfu_misses, 50);
+  ASSERT_EQ(tinylfu_cache.size(), 100);
+}
+
+TEST(TinyLfuPolicy, lru_order_inside_regions)
+{
+  auto miss_handler = [](const int &key, int *data, int8_t &ad_hoc_code, void *)
+  {
+    *data = key * 10;
+    ++ad_hoc_code;
+    return true;
+  };
+
+  Cache<int, int, std::equal_to<int>, TinyLfuPolicy>
+    cache(5, 60s, 1s, miss_handler);
+
+  for (int i = 1; i <= 5; ++i)
+    cache.insert(std::move(i), i * 10);
+
+  ASSERT_EQ(cache.get_lru().first, 1);
+  ASSERT_EQ(cache.get_mru().first, 5);
+
+  ASSERT_TRUE(cache.touch(1));
+  ASSERT_EQ(cache.get_lru().first, 2);
+  ASSERT_EQ(cache.get_mru().first, 1);
+
+  cache.remove(2);
+  ASSERT_EQ(cache.size(), 4);
+  ASSERT_EQ(cache.get_lru().first, 3);
+}
+
+TEST(TinyLfuPolicy, every_hit_is_counted_once)
+{
+  auto miss_handler = [](const int &key, int *data, int8_t &ad_hoc_code, void *)
+  {
+    *data = key * 10;
+    ++ad_hoc_code;
+    return true;
+  };
+
+  Cache<int, int, std::equal_to<int>, TinyLfuPolicy>
+    cache(100, 60s, 1s, miss_handler);
+  const auto frequency = [&cache] (int key)
+    {
+      return cache.eviction_policy.get_sketch().frequency(cache.hash_of(key));
+    };
+
+  // the miss counts its insertion and the promotion of the computed pair
+  cache.retrieve_from_cache_or_compute(1);
+  ASSERT_EQ(frequency(1), 2);
+
+  // the deferred hits are counted when they are drained
+  cache.retrieve_from_cache_or_compute(1);
+  cache.retrieve_from_cache_or_compute(1);
+  cache.get_mru(); // drains
+  ASSERT_EQ(frequency(1), 4);
+
+  // the direct ones, immediately
+  ASSERT_TRUE(cache.touch(1));
+  ASSERT_EQ(frequency(1), 5);
+
+  cache.deferred_mru() = false;
+  cache.retrieve_from_cache_or_compute(1);
+  ASSERT_EQ(frequency(1), 6);
+
+  cache.insert(2, 20);
+  ASSERT_EQ(frequency(2), 1);
+}
+
+struct RandomTimeFixture : public Test
+{
+  static bool miss_handler(const int &key, int *data,
+                           int8_t &ad_hoc_code, void *)
+  {
+    *data = key * 10;
     ++ad_hoc_code; // never must be greater than 1
 
+    // sleep for a random time between 0.5 s and 9.5 s
+    this_thread::sleep_for(chrono::milliseconds(500) +
+                           chrono::milliseconds(rand() % 9000));
+
     return true;
   }
 
   Cache<int, int> cache;
 
-  CookieHandler()
-    : cache(5, 1s, 1s, miss_handler)
+  RandomTimeFixture()
+    : cache(1019, 10s, 1s, miss_handler)
   {
     // empty
   }
 };
-TEST_F(CookieHandler, cookie)
+
+TEST_F(RandomTimeFixture, random_miss_handler)
 {
-  Parameters params = {10, 20};
-  auto cookie = static_cast<void *>(&params);
+  constexpr int N = 30;
+  vector<future<pair<int *, int8_t>>> futures;
 
-  auto [data, ad_hoc_code] =
-    cache.retrieve_from_cache_or_compute(1, cookie);
+  for (int i = 1; i <= 5; ++i)
+    {
+      for (int j = 0; j < N; ++j)
+        {
+          futures.push_back(std::async(std::launch::async, [this, i]()
+          {
+            return cache.retrieve_from_cache_or_compute(i);
+          }));
+        }
+    }
 
-  ASSERT_EQ(cache.size(), 1);
-  ASSERT_TRUE(cache.has(1));
+  vector<pair<int *, int8_t>> results;
+  for (int i = 0; i < N * 5; ++i)
+    results.push_back(futures[i].get());
 
-  ASSERT_EQ(*data, 30);
-  ASSERT_EQ(ad_hoc_code, 1);
+  ASSERT_EQ(cache.size(), 5);
+
+  for (int i = 1; i <= 5; ++i)
+    ASSERT_TRUE(cache.has(i));
+
+  for (int i = 0; i < N * 5; i += N)
+    {
+      auto res_i = results[i];
+      for (int j = 1; j < N; ++j)
+        {
+          auto res_j = results[i + j];
+          ASSERT_EQ(res_i.first, res_j.first); // same address
+          ASSERT_EQ(res_i.second, res_j.second);
+        }
+    }
+}
+
+struct ComplexKey : public Test
+{
+  using Tree = DynSetTree<int>;
+
+  template <typename ... Args>
+  Tree create_key(Args ... args)
+  {
+    Tree key;
+    (key.insert(args), ...);
+    return key;
+  }
+
+  static size_t hash_fct(const Tree &tree)
+  {
+    return tree.foldl<size_t>(0, [](size_t acc, int i)
+    {
+      return acc ^ SuperFastHash(i);
+    });
+  }
+
+  static bool miss_handler(const Tree &tree, int *data,
+                           int8_t &ad_hoc_code, void *)
+  {
+    *data = tree.foldl<int>(0, [](int acc, int i)
+    {
+      return acc + i;
+    });
+    ++ad_hoc_code; // never must be greater than 1
+
+    return true;
+  }
+
+  Cache<Tree, int> cache = Cache<Tree, int>(3, 2s, 1s,
+                                            miss_handler,
+                                            hash_fct);
+
+};
+
+TEST_F(ComplexKey, key_creation)
+{
+  // a key with just a node
+  auto tree_1 = create_key(1);
+  ASSERT_EQ(tree_1.size(), 1);
+  ASSERT_TRUE(tree_1.contains(1));
+
+  // a key with 3 nodes
+  auto tree_2 = create_key(1, 2, 3);
+  ASSERT_EQ(tree_2.size(), 3);
+  ASSERT_TRUE(tree_2.contains(1));
+  ASSERT_TRUE(tree_2.contains(2));
+  ASSERT_TRUE(tree_2.contains(3));
+}
+
+TEST_F(ComplexKey, hash_fct)
+{
+  auto tree_1 = create_key(1);
+  auto tree_2 = create_key(11, 20, 30);
+
+  cout << "Hash tree_1: " << hash_fct(tree_1) << endl
+       << "Hash tree_2: " << hash_fct(tree_2) << endl;
+
+  ASSERT_EQ(hash_fct(tree_1), hash_fct(tree_1));
+  ASSERT_EQ(hash_fct(tree_2), hash_fct(tree_2));
+  ASSERT_NE(hash_fct(tree_1), hash_fct(tree_2));
+}
+
+TEST_F(ComplexKey, cache)
+{
+  auto tree_1 = create_key(1);
+  auto tree_2 = create_key(11, 20, 30);
+
+  auto [data_1, ad_hoc_code_1] = cache.retrieve_from_cache_or_compute(tree_1);
+  auto [data_2, ad_hoc_code_2] = cache.retrieve_from_cache_or_compute(tree_2);
+
+  ASSERT_EQ(cache.size(), 2);
+  ASSERT_TRUE(cache.has(tree_1));
+  ASSERT_TRUE(cache.has(tree_2));
+
+  ASSERT_EQ(*data_1, 1);
+  ASSERT_EQ(*data_2, 61);
+
+  ASSERT_EQ(ad_hoc_code_1, 1);
+  ASSERT_EQ(ad_hoc_code_2, 1);
+}
+
+struct CookieHandler : public Test
+{
+  struct Parameters
+  {
+    int a;
+    int b;
+  };
+
+  static bool miss_handler(const int &key, int *data,
+                           int8_t &ad_hoc_code,
+                           void *cookie)
+  {
+    Parameters *params = static_cast<Parameters *>(cookie);
+    cout << "Params: " << params->a << " " << params->b << endl;
+
+    *data = params->a + params->b;
+    ++ad_hoc_code; // never must be greater than 1
+
+    return true;
+  }
+
+  Cache<int, int> cache;
+
+  CookieHandler()
+    : cache(5, 1s, 1s, miss_handler)
+  {
+    // empty
+  }
+};
+TEST_F(CookieHandler, cookie)
+{
+  Parameters params = {10, 20};
+  auto cookie = static_cast<void *>(&params);
+
+  auto [data, ad_hoc_code] =
+    cache.retrieve_from_cache_or_compute(1, cookie);
+
+  ASSERT_EQ(cache.size(), 1);
+  ASSERT_TRUE(cache.has(1));
+
+  ASSERT_EQ(*data, 30);
+  ASSERT_EQ(ad_hoc_code, 1);
+}
+
+struct CompressionFixture : public Test
+{
+  // the value of key i is i repeated i times; so the values of the big
+  // keys are very compressible
+  static bool miss_handler(const int &key, string *data, int8_t &ad_hoc_code,
+                           void *)
+  {
+    if (key < 0)
+      {
+        ad_hoc_code = -1;
+        return false;
+      }
+
+    *data = string(key, 'a' + key % 26);
+    return true;
+  }
+
+  Cache<int, string> cache;
+
+  CompressionFixture()
+    : cache(10, 10s, 10s, miss_handler, dft_hash_fct<int>, true)
+  {
+    // empty
+  }
+};
+
+TEST_F(CompressionFixture, basic_compression)
+{
+  ASSERT_TRUE(cache.compression());
+  ASSERT_TRUE(cache.insert_compressed(1000, string(1000, 'x')));
+  ASSERT_FALSE(cache.insert_compressed(1000, string(1000, 'y')));
+  ASSERT_TRUE(cache.insert_compressed(3, "abc"));
+
+  auto *big = cache.search_entry(1000);
+  ASSERT_NE(big, nullptr);
+  const CompressedValue &big_value = cache.compressed_value(big);
+  ASSERT_TRUE(big_value.compressed);
+  ASSERT_LT(big_value.bytes.size(), big_value.original_size / 3);
+  ASSERT_TRUE(big->get_data().empty()); // the data is only kept compressed
+
+  // below the threshold the value is only serialized
+  const CompressedValue &small_value = cache.compressed_value(cache.search_entry(3));
+  ASSERT_FALSE(small_value.compressed);
+  ASSERT_EQ(small_value.bytes.size(), small_value.original_size);
+
+  ASSERT_EQ(cache.retrieve_decompressed(1000).first, string(1000, 'x'));
+  ASSERT_EQ(cache.retrieve_decompressed(3).first, "abc");
+
+  // once removed, the compressed value is released
+  const size_t pos = cache.arena_pos(big);
+  cache.remove(1000);
+  ASSERT_TRUE(cache.compressed_values[pos].bytes.empty());
+
+  ASSERT_THROW(cache.insert(7, "x"), domain_error);
+  ASSERT_THROW(cache.retrieve_from_cache_or_compute(7), domain_error);
+  ASSERT_THROW(cache.retrieve_async(7), domain_error);
+}
+
+TEST_F(CompressionFixture, retrieve_with_compression)
+{
+  for (int i = 0; i < 200; i += 20)
+    {
+      auto [data, code] = cache.retrieve_decompressed(i);
+      ASSERT_EQ(data, string(i, 'a' + i % 26));
+      ASSERT_EQ(code, 0);
+    }
+
+  ASSERT_EQ(cache.size(), 10);
+
+  size_t compressed_size = 0;
+  auto [called, code] =
+    cache.retrieve_compressed(180, [&compressed_size] (const CompressedValue &v)
+      {
+        compressed_size = v.bytes.size();
+        ASSERT_EQ(decompress_value<string>(v), string(180, 'a' + 180 % 26));
+      });
+  ASSERT_TRUE(called);
+  ASSERT_GT(compressed_size, 0);
+  ASSERT_LT(compressed_size, 180);
+
+  // failed computations are not stored and the op is not called
+  auto [failed, failed_code] =
+    cache.retrieve_compressed(-1, [] (const CompressedValue &) { FAIL(); });
+  ASSERT_FALSE(failed);
+  ASSERT_EQ(failed_code, -1);
+  ASSERT_EQ(cache.retrieve_decompressed(-1).first, string());
+
+  // an uncompressed cache also supports retrieve_decompressed()
+  Cache<int, string> plain(10, 10s, 10s, miss_handler);
+  ASSERT_EQ(plain.retrieve_decompressed(100).first, string(100, 'a' + 100 % 26));
+  ASSERT_THROW(plain.retrieve_compressed(100, [] (const CompressedValue &) {}),
+               domain_error);
+}
+
+TEST_F(CompressionFixture, values_in_serial_memory)
+{
+  const string file_name = TempDir() + "cpp-cache_test.arena";
+  Cache<int, string> mapped(10, 10s, 10s, miss_handler, dft_hash_fct<int>, true);
+  mapped.enable_serial_memory(file_name, 1024);
+
+  Cache<int, string> plain(10, 10s, 10s, miss_handler);
+  ASSERT_THROW(plain.enable_serial_memory(file_name, 1024), domain_error);
+
+  for (int i = 0; i < 200; i += 10)
+    ASSERT_EQ(mapped.retrieve_decompressed(i).first, string(i, 'a' + i % 26));
+
+  // the evicted values released their blocks
+  const SerialMemory *memory = mapped.serial_memory();
+  ASSERT_GT(memory->bytes_used(), 0);
+  ASSERT_LE(memory->bytes_used(), 10 * SerialMemory::block_size(SerialMemory::size_class(200)));
+
+  // the bytes are out of the heap, unless the store is full
+  size_t num_mapped = 0;
+  for (int i = 100; i < 200; i += 10)
+    mapped.retrieve_compressed(i, [&num_mapped] (const CompressedValue &v)
+      {
+        ASSERT_EQ(v.bytes.empty(), v.external.data() != nullptr);
+        num_mapped += v.bytes.empty();
+      });
+  ASSERT_GT(num_mapped, 0);
+
+  // the re-encoded values move to new blocks
+  mapped.train_dictionary();
+  ASSERT_EQ(mapped.reencode(mapped.max_size()), 10);
+  for (int i = 100; i < 200; i += 10)
+    ASSERT_EQ(mapped.retrieve_decompressed(i).first, string(i, 'a' + i % 26));
+
+  std::remove(file_name.c_str());
+}
+
+TEST(Serialization, thread_buffers_are_reused)
+{
+  const string big(4096, 'z');
+  CompressedValue value;
+  compress_value(big, 64, value); // grows the buffers of the thread
+  ASSERT_TRUE(value.compressed);
+
+  const SerializationCounters before = serialization_counters();
+  for (int i = 0; i < 10; ++i)
+    {
+      compress_value(big, 64, value);
+      ASSERT_EQ(decompress_value<string>(value), big);
+    }
+  const SerializationCounters &after = serialization_counters();
+
+  ASSERT_EQ(after.values - before.values, 20);
+  ASSERT_EQ(after.allocations, before.allocations);
+  ASSERT_EQ(after.bytes_copied - before.bytes_copied, 10 * value.bytes.size());
+
+  // incompressible values are kept serialized and read in place
+  mt19937 gen(7);
+  vector<char> noise(256);
+  for (auto &c: noise)
+    c = char(gen());
+  compress_value(noise, 64, value);
+  ASSERT_FALSE(value.compressed);
+  ASSERT_EQ(decompress_value<vector<char>>(value), noise);
+}
+
+// the serialization pipeline used before the thread buffers: a copy from
+// the stream to a string, another one to a vector and a new lz4 output
+static vector<char> stringstream_compress(const string &value)
+{
+  ostringstream oss;
+  {
+    cereal::BinaryOutputArchive archive(oss);
+    archive(TypeWrapper<string>(value));
+  }
+  string str = oss.str();
+  vector<char> serialized(str.begin(), str.end());
+  vector<char> out;
+  lz4_compress(serialized, out);
+  return out;
+}
+
+TEST(SerializationThroughput, buffers_vs_stringstream)
+{
+  constexpr size_t num_values = 20000;
+  for (size_t len: {128, 1024, 16384})
+    {
+      const string value(len, 'q');
+
+      auto start = high_resolution_clock::now();
+      size_t total = 0;
+      for (size_t i = 0; i < num_values; ++i)
+        total += stringstream_compress(value).size();
+      const double old_ns =
+        duration<double, nano>(high_resolution_clock::now() - start).count() /
+        num_values;
+
+      CompressedValue compressed;
+      const SerializationCounters before = serialization_counters();
+      start = high_resolution_clock::now();
+      for (size_t i = 0; i < num_values; ++i)
+        {
+          compress_value(value, 64, compressed);
+          total -= compressed.bytes.size();
+        }
+      const double new_ns =
+        duration<double, nano>(high_resolution_clock::now() - start).count() /
+        num_values;
+      const SerializationCounters &after = serialization_counters();
+
+      ASSERT_EQ(total, 0);
+      cout << len << " bytes: stringstream " << old_ns << " ns/value, buffers "
+           << new_ns << " ns/value, "
+           << double(after.bytes_copied - before.bytes_copied) / num_values
+           << " bytes copied/value, "
+           << double(after.allocations - before.allocations) / num_values
+           << " allocations/value" << endl;
+    }
+}
+
+// small records with the same structure, as the ones that a cache
+// usually holds
+static string make_record(int id)
+{
+  ostringstream s;
+  s << "{\"id\":" << id << ",\"name\":\"customer-" << id * 7919 % 10007
+    << "\",\"email\":\"customer" << id << "@example.com\""
+    << ",\"status\":\"" << (id % 3 ? "active" : "suspended") << "\""
+    << ",\"roles\":[\"reader\",\"writer\"],\"country\":\"VE\""
+    << ",\"created_at\":\"2024-11-08T10:" << id % 60 << ":00Z\""
+    << ",\"balance\":" << id * 31 % 1000 << "." << id % 100
+    << ",\"preferences\":{\"language\":\"es\",\"newsletter\":"
+    << (id % 2 ? "true" : "false") << ",\"theme\":\"dark\"}}";
+  return s.str();
+}
+
+static size_t stored_bytes(span<const CompressedValue> values)
+{
+  size_t total = 0;
+  for (const auto &v: values)
+    total += v.bytes.size();
+  return total;
+}
+
+TEST(CompressionDictionary, small_records_compress_better)
+{
+  vector<vector<char>> samples;
+  for (int i = 0; i < 200; ++i)
+    samples.push_back(serialize_value(make_record(100000 + i)));
+  auto dict = CompressionDictionary::train(samples, 16 * 1024);
+  ASSERT_EQ(dict->size(), 16 * 1024);
+
+  vector<CompressedValue> plain(1000), with_dict(1000);
+  size_t original = 0;
+  for (int i = 0; i < 1000; ++i)
+    {
+      compress_value(make_record(i), 64, plain[i]);
+      compress_value(make_record(i), 64, with_dict[i], dict);
+      original += with_dict[i].original_size;
+      ASSERT_EQ(decompress_value<string>(with_dict[i]), make_record(i));
+    }
+
+  const size_t plain_size = stored_bytes(plain);
+  const size_t dict_size = stored_bytes(with_dict);
+  cout << "records of " << original / 1000 << " bytes: plain lz4 "
+       << double(original) / plain_size << "x, with dictionary "
+       << double(original) / dict_size << "x" << endl;
+
+  ASSERT_LT(dict_size, plain_size / 2);
+}
+
+struct DictionaryFixture : public Test
+{
+  static bool miss_handler(const int &key, string *data, int8_t &, void *)
+  {
+    *data = make_record(key);
+    return true;
+  }
+
+  static constexpr int num_keys = 500;
+
+  Cache<int, string> cache;
+
+  DictionaryFixture()
+    : cache(num_keys, 60s, 60s, miss_handler, dft_hash_fct<int>, true)
+  {
+    for (int i = 0; i < num_keys; ++i)
+      cache.retrieve_decompressed(i);
+  }
+};
+
+TEST_F(DictionaryFixture, train_and_reencode)
+{
+  // the cache was not resized; so its values are in the first chunk
+  span<const CompressedValue> values(&cache.compressed_values[0],
+                                     cache.max_size());
+  const size_t plain_size = stored_bytes(values);
+
+  auto dict = cache.train_dictionary(100, 8 * 1024);
+  ASSERT_NE(dict, nullptr);
+  ASSERT_EQ(cache.dictionary(), dict);
+
+  // the new values use the dictionary
+  ASSERT_EQ(cache.retrieve_decompressed(num_keys).first, make_record(num_keys));
+  ASSERT_EQ(cache.compressed_value(cache.search_entry(num_keys)).dictionary, dict);
+  cache.remove(num_keys);
+
+  size_t num_reencoded = 0;
+  for (size_t i = 0; i < cache.max_size(); i += 64)
+    num_reencoded += cache.reencode(64);
+  ASSERT_EQ(num_reencoded, num_keys - 1); // one was evicted by num_keys
+  ASSERT_EQ(cache.reencode(cache.max_size()), 0); // nothing is stale
+
+  for (int i = 0; i < num_keys; ++i)
+    ASSERT_EQ(cache.retrieve_decompressed(i).first, make_record(i));
+
+  const size_t dict_size = stored_bytes(values);
+  cout << "cache values: plain " << plain_size << " bytes, with dictionary "
+       << dict_size << " bytes" << endl;
+  ASSERT_LT(dict_size, plain_size / 2);
+}
+
+TEST_F(DictionaryFixture, retrain_in_background)
+{
+  cache.train_dictionary(50, 4 * 1024);
+  ASSERT_TRUE(cache.retrain_in_background());
+
+  // the cache is used while it is being re-encoded
+  for (int round = 0; round < 3; ++round)
+    for (int i = 0; i < num_keys; ++i)
+      ASSERT_EQ(cache.retrieve_decompressed(i).first, make_record(i));
+
+  ASSERT_GT(cache.wait_retraining(), 0);
+
+  // the values that were pinned by the readers were skipped
+  cache.reencode(cache.max_size());
+  ASSERT_EQ(cache.reencode(cache.max_size()), 0);
+}
+
+struct ByteBudgetFixture : public Test
+{
+  // the value of key i has i bytes, rounded down to hundreds
+  static bool miss_handler(const int &key, string *data, int8_t &, void *)
+  {
+    *data = string(key / 100 * 100, 'b');
+    return true;
+  }
+
+  static constexpr size_t weight(size_t len) { return sizeof(string) + len; }
+
+  Cache<int, string> cache;
+
+  ByteBudgetFixture()
+    : cache(100, 60s, 60s, miss_handler)
+  {
+    cache.set_byte_budget(10 * weight(1000));
+  }
+};
+
+TEST_F(ByteBudgetFixture, evicts_by_bytes)
+{
+  for (int i = 0; i < 10; ++i)
+    cache.retrieve_from_cache_or_compute(1000 + i);
+  ASSERT_EQ(cache.size(), 10);
+  ASSERT_EQ(cache.bytes_used(), 10 * weight(1000));
+
+  // a value of 5000 bytes evicts 5 values of 1000 bytes
+  cache.retrieve_from_cache_or_compute(5000);
+  ASSERT_EQ(cache.size(), 6);
+  ASSERT_LE(cache.bytes_used(), cache.byte_budget());
+  for (int i = 0; i < 5; ++i)
+    ASSERT_FALSE(cache.has(1000 + i)); // the lru ones
+  for (int i = 5; i < 10; ++i)
+    ASSERT_TRUE(cache.has(1000 + i));
+
+  // small values are bounded by the number of entries
+  for (int i = 0; i < 200; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+  ASSERT_LE(cache.size(), cache.capacity());
+  ASSERT_LE(cache.bytes_used(), cache.byte_budget());
+
+  for (int i = 0; i < 200; ++i)
+    cache.remove(i);
+  cache.remove(5000);
+  for (int i = 0; i < 10; ++i)
+    cache.remove(1000 + i);
+  ASSERT_EQ(cache.size(), 0);
+  ASSERT_EQ(cache.bytes_used(), 0);
+}
+
+TEST_F(ByteBudgetFixture, weigher_and_compression)
+{
+  cache.retrieve_from_cache_or_compute(1);
+  ASSERT_THROW(cache.set_byte_budget(1), domain_error); // it is in use
+
+  Cache<int, string> weighed(100, 60s, 60s, miss_handler);
+
+  weighed.set_byte_budget(1000, [] (const int &key, const string &)
+                                {
+                                  return size_t(key) * 100;
+                                });
+  weighed.retrieve_from_cache_or_compute(5);
+  weighed.retrieve_from_cache_or_compute(4);
+  ASSERT_EQ(weighed.bytes_used(), 900);
+  weighed.retrieve_from_cache_or_compute(2); // 5 is evicted
+  ASSERT_FALSE(weighed.has(5));
+  ASSERT_EQ(weighed.bytes_used(), 600);
+
+  // in compression mode the compressed size is accounted; so the
+  // compressible values take much less of the budget
+  Cache<int, string> compressed(100, 60s, 60s, miss_handler,
+                                dft_hash_fct<int>, true);
+  compressed.set_byte_budget(10 * weight(1000));
+  for (int i = 0; i < 50; ++i)
+    compressed.retrieve_decompressed(1000 + i);
+  ASSERT_EQ(compressed.size(), 50);
+  ASSERT_LT(compressed.bytes_used(), 50 * (sizeof(CompressedValue) + 100));
+}
+
+TEST(TimerWheel, expires_in_order)
+{
+  constexpr size_t num_items = 2000;
+  TimerWheel wheel(num_items, 1000);
+
+  // expirations spread through all the levels, some beyond the horizon
+  vector<int64_t> expiration(num_items);
+  for (size_t i = 0; i < num_items; ++i)
+    {
+      expiration[i] = 1000 + int64_t(i * i * 7919 % (3 * TimerWheel::horizon / 2));
+      wheel.schedule(i, expiration[i]);
+    }
+  wheel.cancel(5);
+  wheel.schedule(6, 1003); // rescheduled
+  expiration[6] = 1003;
+  ASSERT_EQ(wheel.size(), num_items - 1);
+
+  vector<bool> popped(num_items, false);
+  popped[5] = true;
+  vector<uint32_t> expired;
+  size_t num_popped = 1;
+  for (int64_t now = 1000; num_popped < num_items; now += 1 + now % 5000)
+    {
+      wheel.advance(now);
+      expired.clear();
+      wheel.pop_expired(num_items, expired);
+      for (uint32_t pos: expired)
+        {
+          ASSERT_FALSE(popped[pos]);
+          ASSERT_LE(expiration[pos], now); // even beyond the horizon
+          popped[pos] = true;
+          ++num_popped;
+        }
+
+      for (size_t i = 0; i < num_items; ++i) // nothing is missed
+        ASSERT_TRUE(popped[i] or expiration[i] > now);
+    }
+
+  ASSERT_EQ(wheel.size(), 0);
+}
+
+TEST(TimerWheel, expirations_beyond_the_horizon)
+{
+  TimerWheel wheel(3, 0);
+
+  const int64_t far = 3 * TimerWheel::horizon + 5;
+  wheel.schedule(0, far);
+  wheel.schedule(1, TimerWheel::horizon - 1);
+  wheel.schedule(2, 2 * TimerWheel::horizon);
+
+  vector<uint32_t> expired;
+  wheel.advance(TimerWheel::horizon);
+  wheel.pop_expired(3, expired);
+  ASSERT_EQ(expired, vector<uint32_t>({1}));
+
+  wheel.advance(far - 1);
+  expired.clear();
+  wheel.pop_expired(3, expired);
+  ASSERT_EQ(expired, vector<uint32_t>({2}));
+
+  wheel.advance(far);
+  expired.clear();
+  wheel.pop_expired(3, expired);
+  ASSERT_EQ(expired, vector<uint32_t>({0}));
+  ASSERT_EQ(wheel.size(), 0);
+}
+
+struct ReapFixture : public Test
+{
+  static bool miss_handler(const int &key, int *data, int8_t &, void *)
+  {
+    *data = key;
+    return key >= 0;
+  }
+
+  Cache<int, int> cache;
+
+  ReapFixture()
+    : cache(100, 1s, 1s, miss_handler)
+  {
+    cache.enable_reaping(10ms);
+  }
+};
+
+TEST_F(ReapFixture, expired_entries_are_reaped)
+{
+  for (int i = -10; i < 40; ++i) // the failed ones are reaped as well
+    cache.retrieve_from_cache_or_compute(i);
+  ASSERT_EQ(cache.size(), 50);
+  ASSERT_EQ(cache.reap(), 0);
+
+  // an entry being used is not reaped
+  auto pinned = cache.pin_entry(0);
+
+  this_thread::sleep_for(1100ms);
+  ASSERT_EQ(cache.reap(20), 20); // the budget is respected
+  ASSERT_EQ(cache.reap(), 29);
+  ASSERT_EQ(cache.size(), 1);
+
+  cache.unpin(pinned.first);
+  this_thread::sleep_for(20ms);
+  ASSERT_EQ(cache.reap(), 1);
+  ASSERT_EQ(cache.size(), 0);
+
+  // the recomputed entries are scheduled again
+  cache.retrieve_from_cache_or_compute(1);
+  ASSERT_EQ(cache.reap(), 0);
+  ASSERT_EQ(cache.size(), 1);
+}
+
+TEST_F(ReapFixture, background_reaper)
+{
+  Cache<int, int> not_reaping(10, 1s, 1s, miss_handler);
+  ASSERT_THROW(not_reaping.reap(), domain_error);
+
+  cache.start_reaper(50ms);
+  for (int i = 0; i < 100; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+  ASSERT_EQ(cache.size(), 100);
+
+  this_thread::sleep_for(1300ms);
+  ASSERT_EQ(cache.size(), 0);
+  cache.stop_reaper();
+}
+
+struct RefreshFixture : public Test
+{
+  // the data is the number of times that the key has been computed
+  static bool miss_handler(const int &key, int *data, int8_t &, void *cookie)
+  {
+    auto *calls = static_cast<atomic<int> *>(cookie);
+    *data = ++calls[key];
+    if (key == 1)
+      Cache<int, int>::set_miss_ttl(300ms);
+    this_thread::sleep_for(100ms); // a slow computation
+    return true;
+  }
+
+  atomic<int> calls[8] = {};
+
+  Cache<int, int> cache;
+
+  RefreshFixture()
+    : cache(10, 1s, 1s, miss_handler)
+  {
+    // empty
+  }
+};
+
+TEST_F(RefreshFixture, miss_handler_sets_the_ttl)
+{
+  cache.retrieve_from_cache_or_compute(1, calls);
+  cache.retrieve_from_cache_or_compute(2, calls);
+  this_thread::sleep_for(400ms);
+  ASSERT_FALSE(cache.has(1));
+  ASSERT_TRUE(cache.has(2));
+
+  // the ttl of a batch request
+  using MissRequest = Cache<int, int>::MissRequest;
+  cache.batch_miss_handler = [] (span<MissRequest> requests, void *)
+    {
+      for (auto &request: requests)
+        {
+          *request.data = request.key;
+          request.ttl = request.key == 3 ? 100ms : 10s;
+          request.success = true;
+        }
+    };
+  vector<int> keys = {3, 4};
+  cache.retrieve_many(span<const int>(keys));
+  this_thread::sleep_for(200ms);
+  ASSERT_FALSE(cache.has(3));
+  ASSERT_TRUE(cache.has(4));
+}
+
+TEST_F(RefreshFixture, near_expiration_hits_do_not_wait)
+{
+  cache.enable_refresh_ahead(500ms, calls);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(2, calls).first, 1);
+
+  this_thread::sleep_for(600ms); // within the window
+
+  // many hits ask for a single refresh and none waits for it
+  auto start = high_resolution_clock::now();
+  for (int i = 0; i < 100; ++i)
+    ASSERT_EQ(*cache.retrieve_from_cache_or_compute(2, calls).first, 1);
+  ASSERT_LT(high_resolution_clock::now() - start, 50ms);
+
+  this_thread::sleep_for(300ms); // the refresh finishes
+  ASSERT_EQ(calls[2], 2);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(2, calls).first, 2);
+
+  // the ttl was renewed: the pair is still there after the original ttl
+  this_thread::sleep_for(300ms);
+  ASSERT_TRUE(cache.has(2));
+}
+
+TEST_F(RefreshFixture, costly_pairs_expire_early)
+{
+  // the computation takes 100ms; so the pair is likely to be computed
+  // again during the last second of its ttl
+  using Clock = Cache<int, int>::Clock;
+  cache.enable_early_expiration(10);
+  const auto start = Clock::now();
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(2, calls).first, 1);
+
+  while (calls[2] == 1 and Clock::now() - start < 2s)
+    {
+      cache.retrieve_from_cache_or_compute(2, calls);
+      this_thread::sleep_for(10ms);
+    }
+
+  ASSERT_EQ(calls[2], 2);
+  ASSERT_LT(Clock::now() - start, 1s); // before its expiration
+  if (cache_stats_enabled)
+    {
+      ASSERT_EQ(cache.stats().early_expirations, 1);
+    }
+
+  // the inserted pairs have no measured cost
+  cache.insert(3, 3);
+  this_thread::sleep_for(900ms);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(3, calls).first, 3);
+}
+
+TEST_F(RefreshFixture, ttl_jitter_spreads_the_expirations)
+{
+  using Clock = Cache<int, int>::Clock;
+  cache.set_ttl_jitter(0.5);
+  cache.miss_handler = [] (const int &key, int *data, int8_t &, void *)
+    {
+      *data = key;
+      return true;
+    };
+
+  const auto start = Clock::now();
+  set<Clock::time_point> exp_times;
+  for (int i = 0; i < 10; ++i)
+    {
+      cache.retrieve_from_cache_or_compute(i);
+      const auto exp_time = cache.search_entry(i)->ttl_exp_time();
+      ASSERT_GE(exp_time, start + 500ms);
+      ASSERT_LE(exp_time, Clock::now() + 1s);
+      exp_times.insert(exp_time);
+    }
+
+  ASSERT_GT(exp_times.size(), 5);
+
+  // an explicit ttl is kept
+  cache.miss_handler = [] (const int &key, int *data, int8_t &, void *)
+    {
+      *data = key;
+      Cache<int, int>::set_miss_ttl(2s);
+      return true;
+    };
+  for (int i = 10; i < 15; ++i)
+    {
+      const auto before = Clock::now();
+      cache.retrieve_from_cache_or_compute(i);
+      ASSERT_GE(cache.search_entry(i)->ttl_exp_time(), before + 2s);
+    }
+}
+
+struct SnapshotFixture : public Test
+{
+  // the data is the key repeated as many times as it has been computed
+  static bool miss_handler(const int &key, string *data, int8_t &code, void *cookie)
+  {
+    auto *calls = static_cast<atomic<int> *>(cookie);
+    const int n = ++calls[key];
+    *data = string(100, 'a' + key % 26) + to_string(n);
+    code = key % 3;
+    if (key == 7)
+      Cache<int, string>::set_miss_ttl(100ms);
+    return true;
+  }
+
+  atomic<int> calls[64] = {};
+
+  string path = testing::TempDir() + "cpp-cache_test.snapshot";
+
+  ~SnapshotFixture() { std::remove(path.c_str()); }
+};
+
+TEST_F(SnapshotFixture, warm_restart)
+{
+  Cache<int, string> cache(64, 10s, 10s, miss_handler);
+  for (int key = 0; key < 32; ++key)
+    cache.retrieve_from_cache_or_compute(key, calls);
+  cache.touch(3); // so, 3 is the mru and 0 the lru
+
+  this_thread::sleep_for(150ms); // 7 expires
+  ASSERT_EQ(cache.save_snapshot(path), 31);
+
+  Cache<int, string> restarted(64, 10s, 10s, miss_handler);
+  ASSERT_EQ(restarted.load_snapshot(path), 31);
+  ASSERT_EQ(restarted.size(), 31);
+  ASSERT_TRUE(restarted.has(5));
+  ASSERT_FALSE(restarted.has(7));
+  ASSERT_EQ(restarted.get_lru_entry()->key(), 0);
+  ASSERT_EQ(restarted.get_mru_entry()->key(), 3);
+
+  // the values are read from the snapshot without calling the miss handler
+  for (int key = 0; key < 32; ++key)
+    {
+      auto [data, code] = restarted.retrieve_from_cache_or_compute(key, calls);
+      if (key != 7)
+        {
+          ASSERT_EQ(*data, *cache.retrieve_from_cache_or_compute(key, calls).first);
+        }
+      ASSERT_EQ(code, key % 3);
+    }
+  ASSERT_EQ(calls[5], 1);
+  ASSERT_EQ(calls[7], 2); // expired; so it was computed again
+
+  // a removed pair is not read again from the snapshot
+  Cache<int, string> other(64, 10s, 10s, miss_handler);
+  other.load_snapshot(path);
+  other.remove(5);
+  ASSERT_FALSE(other.has(5));
+  ASSERT_EQ(*other.retrieve_from_cache_or_compute(5, calls).first,
+            string(100, 'f') + "2");
+
+  ASSERT_THROW(other.load_snapshot(path), domain_error);
+}
+
+TEST_F(SnapshotFixture, async_lookups_while_saving)
+{
+  // big values, so that the snapshot holds every pair for a while
+  auto big_values = [] (const int &key, string *data, int8_t &, void *cookie)
+    {
+      ++static_cast<atomic<int> *>(cookie)[key];
+      *data = string(1 << 20, 'a' + key);
+      return true;
+    };
+
+  Cache<int, string> cache(8, 10s, 10s, big_values);
+  for (int key = 0; key < 4; ++key)
+    cache.retrieve_from_cache_or_compute(key, calls);
+
+  // the lookups find the pairs claimed by the snapshot and wait for them
+  atomic<int> num_saves = 0;
+  thread saver([&cache, &num_saves, this]
+    {
+      for (; num_saves < 20; ++num_saves)
+        cache.save_snapshot(path);
+    });
+
+  bool all_ready = true;
+  while (all_ready and num_saves < 20)
+    {
+      vector<future<pair<string *, int8_t>>> results;
+      for (int key = 0; key < 4; ++key)
+        results.push_back(cache.retrieve_async(key, calls));
+
+      for (auto &result: results)
+        all_ready = all_ready and result.wait_for(1s) == future_status::ready;
+    }
+  saver.join();
+  ASSERT_TRUE(all_ready);
+
+  for (int key = 0; key < 4; ++key)
+    {
+      ASSERT_EQ(calls[key], 1);
+      cache.remove(key);
+    }
+  ASSERT_EQ(cache.size(), 0); // no pin was left behind
+}
+
+TEST_F(SnapshotFixture, only_the_most_recent_pairs_fit)
+{
+  Cache<int, string> cache(64, 10s, 10s, miss_handler);
+  vector<int> keys(40);
+  iota(keys.begin(), keys.end(), 0);
+  cache.retrieve_many(span<const int>(keys), calls);
+  ASSERT_EQ(cache.save_snapshot(path), 40);
+
+  Cache<int, string> small(10, 10s, 10s, miss_handler);
+  ASSERT_EQ(small.load_snapshot(path), 10);
+  for (int key = 30; key < 40; ++key)
+    ASSERT_TRUE(small.has(key));
+
+  // the batch and async retrievals also read the snapshot
+  vector<int> recent = {30, 31, 32};
+  for (auto [data, code]: small.retrieve_many(span<const int>(recent), calls))
+    ASSERT_EQ(data->back(), '1');
+  ASSERT_EQ(small.retrieve_async(33, calls).get().first->back(), '1');
+  ASSERT_EQ(calls[30] + calls[33], 2);
+}
+
+TEST_F(SnapshotFixture, compression_mode)
+{
+  Cache<int, string> cache(64, 10s, 10s, miss_handler, dft_hash_fct<int>, true);
+  for (int key = 0; key < 20; ++key)
+    cache.retrieve_decompressed(key, calls);
+  ASSERT_EQ(cache.save_snapshot(path), 20);
+
+  // the snapshot holds the values uncompressed; so it can be loaded in
+  // any mode
+  Cache<int, string> plain(64, 10s, 10s, miss_handler);
+  ASSERT_EQ(plain.load_snapshot(path), 20);
+  Cache<int, string> compressed(64, 10s, 10s, miss_handler, dft_hash_fct<int>, true);
+  ASSERT_EQ(compressed.load_snapshot(path), 20);
+  for (int key = 0; key < 20; ++key)
+    {
+      const string expected = cache.retrieve_decompressed(key, calls).first;
+      ASSERT_EQ(*plain.retrieve_from_cache_or_compute(key, calls).first, expected);
+      ASSERT_EQ(compressed.retrieve_decompressed(key, calls).first, expected);
+    }
+  ASSERT_EQ(calls[0], 1);
+
+  Cache<int, string> empty(8, 1s, 1s, miss_handler);
+  ASSERT_THROW(empty.load_snapshot(path + ".none"), runtime_error);
+}
+
+TEST(ColdTier, put_get_and_compact)
+{
+  const string dir = TempDir() + "cpp-cache_test.cold";
+  ColdTier tier(dir, 1 << 20, 4096, 1024); // small segments and buffer
+  const int64_t exp_time = (CoarseClock::now() + 10s).time_since_epoch().count();
+
+  auto key_of = [] (int i) { return serialize_value(i); };
+  tier.put(key_of(1000), serialize_value(string("old")), 0); // expired
+  for (int i = 0; i < 100; ++i)
+    tier.put(key_of(i), serialize_value(string(100, 'a' + i % 26)), exp_time, i % 3);
+  ASSERT_EQ(tier.size(), 101);
+  ASSERT_GT(tier.num_segments(), 2);
+
+  vector<char> value;
+  int64_t exp;
+  int8_t code;
+  for (int i = 0; i < 100; ++i) // from the files and the buffer
+    {
+      ASSERT_TRUE(tier.get(key_of(i), value, exp, code));
+      ASSERT_EQ(deserialize_value<string>(value), string(100, 'a' + i % 26));
+      ASSERT_EQ(exp, exp_time);
+      ASSERT_EQ(code, i % 3);
+    }
+  ASSERT_FALSE(tier.get(key_of(1000), value, exp, code));
+
+  // the rewritten and erased records become garbage, which is compacted
+  // with the expired ones
+  for (int i = 0; i < 80; ++i)
+    tier.erase(key_of(i));
+  tier.put(key_of(90), serialize_value(string("new")), exp_time);
+  const size_t before = tier.disk_bytes();
+  ASSERT_GT(tier.compact(), 0);
+  ASSERT_LT(tier.disk_bytes(), before);
+  ASSERT_EQ(tier.size(), 20); // the expired one was dropped
+  ASSERT_TRUE(tier.get(key_of(90), value, exp, code, true));
+  ASSERT_EQ(deserialize_value<string>(value), "new");
+  ASSERT_FALSE(tier.get(key_of(90), value, exp, code)); // it was taken
+  for (int i = 80; i < 100; ++i)
+    ASSERT_EQ(tier.get(key_of(i), value, exp, code), i != 90);
+
+  // beyond max_bytes, the oldest segments are dropped
+  ColdTier small(dir + "-small", 8192, 4096, 1024);
+  for (int i = 0; i < 200; ++i)
+    small.put(key_of(i), serialize_value(string(100, 'x')), exp_time);
+  ASSERT_LE(small.disk_bytes(), 8192);
+  ASSERT_FALSE(small.get(key_of(0), value, exp, code));
+  ASSERT_TRUE(small.get(key_of(199), value, exp, code));
+}
+
+TEST(ColdTier, reads_while_the_buffer_is_written)
+{
+  const string dir = TempDir() + "cpp-cache_test.cold-mt";
+  ColdTier tier(dir, 64 << 20, 1 << 16, 1024); // frequent writes and segments
+  const int64_t exp_time = (CoarseClock::now() + 10s).time_since_epoch().count();
+  tier.start_compactor(1ms);
+
+  vector<thread> threads;
+  atomic<int> num_wrong = 0;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&tier, &num_wrong, exp_time, t]
+      {
+        vector<char> value;
+        int64_t exp;
+        int8_t code;
+        for (int i = 0; i < 2000; ++i)
+          {
+            const int key = t * 10000 + i;
+            tier.put(serialize_value(key), serialize_value(string(200, 'a' + i % 26)),
+                     exp_time);
+            if (not tier.get(serialize_value(key), value, exp, code) or
+                deserialize_value<string>(value) != string(200, 'a' + i % 26))
+              ++num_wrong;
+            if (i % 2 == 0) // garbage for the compactor
+              tier.erase(serialize_value(key));
+          }
+      });
+  for (auto &thread: threads)
+    thread.join();
+  tier.stop_compactor();
+
+  ASSERT_EQ(num_wrong, 0);
+  ASSERT_EQ(tier.size(), 4 * 1000);
+}
+
+struct ColdTierFixture : public Test
+{
+  static bool miss_handler(const int &key, string *data, int8_t &code, void *cookie)
+  {
+    ++static_cast<atomic<int> *>(cookie)[key];
+    *data = string(200, 'a' + key % 26);
+    code = 1;
+    return true;
+  }
+
+  atomic<int> calls[100] = {};
+
+  string dir = TempDir() + "cpp-cache_test.tier";
+};
+
+TEST_F(ColdTierFixture, evicted_pairs_are_not_recomputed)
+{
+  for (bool compression: { false, true })
+    {
+      for (auto &c: calls)
+        c = 0;
+
+      Cache<int, string> cache(10, 10s, 10s, miss_handler, dft_hash_fct<int>,
+                               compression);
+      cache.enable_cold_tier(dir, 1 << 20);
+      for (int key = 0; key < 50; ++key)
+        cache.retrieve_decompressed(key, calls);
+      ASSERT_EQ(cache.cold_tier()->size(), 40);
+
+      // the evicted pairs come back from the disk
+      for (int key = 0; key < 50; ++key)
+        {
+          auto [data, code] = cache.retrieve_decompressed(key, calls);
+          ASSERT_EQ(data, string(200, 'a' + key % 26));
+          ASSERT_EQ(code, 1);
+        }
+      for (int key = 0; key < 50; ++key)
+        ASSERT_EQ(calls[key], 1);
+
+      // a removed pair is not read from the tier
+      cache.remove(0);
+      cache.retrieve_decompressed(0, calls);
+      ASSERT_EQ(calls[0], 2);
+    }
+}
+
+TEST_F(ColdTierFixture, demotions_from_several_threads)
+{
+  Cache<int, string> cache(10, 10s, 10s, miss_handler);
+  cache.enable_cold_tier(dir, 1 << 20);
+
+  vector<thread> threads;
+  atomic<int> num_wrong = 0;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([this, &cache, &num_wrong, t]
+      {
+        for (int i = 0; i < 500; ++i)
+          {
+            const int key = (i * 7 + t) % 100;
+            if (cache.retrieve_decompressed(key, calls).first !=
+                string(200, 'a' + key % 26))
+              ++num_wrong;
+          }
+      });
+  for (auto &thread: threads)
+    thread.join();
+
+  ASSERT_EQ(num_wrong, 0);
+  for (int key = 0; key < 100; ++key) // the evicted pairs were not lost
+    ASSERT_EQ(calls[key], 1);
+
+  // neither a queued nor a written demotion survives a removal
+  for (int key = 0; key < 100; ++key)
+    cache.remove(key);
+  for (int key = 0; key < 100; ++key)
+    cache.retrieve_decompressed(key, calls);
+  for (int key = 0; key < 100; ++key)
+    ASSERT_EQ(calls[key], 2);
+}
+
+TEST(LatencyHistogram, buckets_and_percentiles)
+{
+  ASSERT_EQ(LatencyHistogram::bucket(0ns), 0);
+  ASSERT_EQ(LatencyHistogram::bucket(1ns), 1);
+  ASSERT_EQ(LatencyHistogram::bucket(1000ns), 10); // [512, 1024)
+  ASSERT_EQ(LatencyHistogram::bucket(1000s), LatencyHistogram::num_buckets - 1);
+
+  LatencyHistogram h;
+  ASSERT_EQ(h.percentile(0.5), 0ns);
+  for (int i = 0; i < 90; ++i)
+    {
+      ++h.counts[LatencyHistogram::bucket(1000ns)];
+      h.sum += 1000ns;
+    }
+  for (int i = 0; i < 10; ++i)
+    {
+      ++h.counts[LatencyHistogram::bucket(1ms)];
+      h.sum += 1ms;
+    }
+  h.count = 100;
+
+  ASSERT_EQ(h.percentile(0.5), 1024ns);
+  ASSERT_EQ(h.percentile(0.9), 1024ns);
+  ASSERT_EQ(h.percentile(0.99), LatencyHistogram::bucket_limit(20)); // ~1 ms
+  ASSERT_EQ(h.mean(), (90 * 1000ns + 10 * 1ms) / 100);
+}
+
+struct StatsFixture : public Test
+{
+  static bool miss_handler(const int &key, int *data, int8_t &, void *)
+  {
+    if (key == 1000)
+      this_thread::sleep_for(300ms);
+    *data = key;
+    return key >= 0;
+  }
+
+  Cache<int, int> cache;
+
+  StatsFixture()
+    : cache(10, 1s, 1s, miss_handler)
+  {
+    // empty
+  }
+};
+
+TEST_F(StatsFixture, counts_the_events)
+{
+  if (not cache_stats_enabled)
+    GTEST_SKIP() << "the statistics are compiled out";
+
+  for (int key = -2; key < 8; ++key) // two failures
+    cache.retrieve_from_cache_or_compute(key);
+  for (int key = -2; key < 8; ++key)
+    cache.retrieve_from_cache_or_compute(key);
+
+  CacheStats stats = cache.stats();
+  ASSERT_EQ(stats.misses, 10);
+  ASSERT_EQ(stats.hits, 10);
+  ASSERT_EQ(stats.negative_hits, 2);
+  ASSERT_EQ(stats.hit_ratio(), 0.5);
+  ASSERT_EQ(stats.evictions, 0);
+  ASSERT_EQ(stats.miss_latency.count, 10);
+
+  for (int key = 8; key < 20; ++key) // 12 new keys in a cache of 10
+    cache.retrieve_from_cache_or_compute(key);
+  ASSERT_EQ(cache.stats().evictions, 12);
+
+  this_thread::sleep_for(1100ms);
+  cache.retrieve_from_cache_or_compute(19);
+  stats = cache.stats();
+  ASSERT_EQ(stats.expirations, 1);
+  ASSERT_EQ(stats.misses, 23);
+
+  // the waiters of a calculation are hits
+  cache.reset_stats();
+  auto computing = std::async(std::launch::async, [this]
+    {
+      return cache.retrieve_from_cache_or_compute(1000);
+    });
+  this_thread::sleep_for(100ms);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(1000).first, 1000);
+  computing.get();
+
+  stats = cache.stats();
+  ASSERT_EQ(stats.misses, 1);
+  ASSERT_EQ(stats.hits, 1);
+  ASSERT_EQ(stats.calculating_waits, 1);
+  ASSERT_GE(stats.miss_latency.mean(), 300ms);
+  ASSERT_GE(stats.miss_latency.percentile(1), 300ms);
+}
+
+TEST(ShardedStats, sum_of_the_shards)
+{
+  ShardedCache<int, int> cache(100, 60s, 1s, StatsFixture::miss_handler, 4);
+  for (int key = 0; key < 50; ++key)
+    cache.retrieve_from_cache_or_compute(key);
+  for (int key = 0; key < 50; ++key)
+    cache.retrieve_from_cache_or_compute(key);
+
+  const CacheStats stats = cache.stats();
+  if (not cache_stats_enabled)
+    {
+      ASSERT_EQ(stats.lookups(), 0);
+      return;
+    }
+
+  ASSERT_EQ(stats.misses, 50);
+  ASSERT_EQ(stats.hits, 50);
+
+  size_t misses = 0;
+  for (size_t i = 0; i < cache.num_shards(); ++i)
+    misses += cache.get_shard_by_index(i).stats().misses;
+  ASSERT_EQ(misses, 50);
+
+  cache.reset_stats();
+  ASSERT_EQ(cache.stats().lookups(), 0);
+}
+
+// string key that counts its copies
+struct TrackedKey
+{
+  static inline int num_copies = 0;
+
+  string s;
+
+  TrackedKey() = default;
+  TrackedKey(string_view s) : s(s) { ++num_copies; }
+  TrackedKey(const TrackedKey &key) : s(key.s) { ++num_copies; }
+  TrackedKey(TrackedKey &&) = default;
+  TrackedKey &operator=(const TrackedKey &key)
+  {
+    s = key.s;
+    ++num_copies;
+    return *this;
+  }
+  TrackedKey &operator=(TrackedKey &&) = default;
+
+  operator string_view() const noexcept { return s; }
+};
+
+struct TransparentFixture : public Test
+{
+  static bool miss_handler(const TrackedKey &key, int *data, int8_t &, void *)
+  {
+    *data = key.s.size();
+    return true;
+  }
+
+  static bool string_miss_handler(const string &key, int *data, int8_t &, void *)
+  {
+    *data = key.size();
+    return true;
+  }
+};
+
+TEST_F(TransparentFixture, lookups_do_not_build_keys)
+{
+  Cache<TrackedKey, int, StringCmp> cache(10, 60s, 60s, miss_handler);
+
+  const string_view key = "a borrowed key longer than the small string buffer";
+  TrackedKey::num_copies = 0;
+  ASSERT_FALSE(cache.has(key));
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(key).first, key.size());
+  ASSERT_EQ(TrackedKey::num_copies, 1); // the inserted key
+
+  ASSERT_TRUE(cache.has(key));
+  ASSERT_TRUE(cache.touch(key));
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(key).first, key.size());
+  ASSERT_EQ(cache.retrieve_decompressed(key).first, key.size());
+  ASSERT_EQ(*cache.retrieve_async(key).get().first, key.size());
+  ASSERT_EQ(TrackedKey::num_copies, 1);
+
+  // the lookups by key and by borrowed key find the same entry
+  ASSERT_TRUE(cache.has(TrackedKey(key)));
+  cache.remove(key);
+  ASSERT_FALSE(cache.has(key));
+
+  // an inserted key is moved to its entry
+  TrackedKey::num_copies = 0;
+  TrackedKey inserted("another key");
+  ASSERT_NE(cache.insert(std::move(inserted), 3), nullptr);
+  ASSERT_EQ(TrackedKey::num_copies, 1);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute("another key").first, 3);
+}
+
+TEST_F(TransparentFixture, string_keys)
+{
+  Cache<string, int, StringCmp> cache(10, 60s, 60s, string_miss_handler);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute("abc").first, 3);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(string_view("abc")).first, 3);
+  ASSERT_EQ(*cache.retrieve_from_cache_or_compute(string("abc")).first, 3);
+  ASSERT_EQ(cache.size(), 1);
+
+  ShardedCache<string, int, StringCmp> sharded(1000, 60s, 60s,
+                                               string_miss_handler, 4);
+  for (int i = 0; i < 100; ++i)
+    sharded.retrieve_from_cache_or_compute(to_string(i));
+  for (int i = 0; i < 100; ++i) // a borrowed key goes to the shard of its key
+    ASSERT_TRUE(sharded.has(string_view(to_string(i))));
+  ASSERT_EQ(sharded.size(), 100);
+}
+
+TEST(ChunkedArray, grows_without_moving)
+{
+  ChunkedArray<int> array(5, -1);
+  ASSERT_EQ(array.size(), 8);
+  for (size_t i = 0; i < array.size(); ++i)
+    array[i] = i;
+
+  int *first = &array[0];
+  int *last = &array[7];
+  array.grow(100, -1);
+  ASSERT_EQ(array.size(), 128);
+  ASSERT_EQ(&array[0], first);
+  ASSERT_EQ(&array[7], last);
+  for (size_t i = 0; i < 8; ++i)
+    ASSERT_EQ(array[i], i);
+  for (size_t i = 8; i < array.size(); ++i)
+    ASSERT_EQ(array[i], -1);
+}
+
+// counts the keys hashed by the caches using it
+struct CountingHash
+{
+  static inline atomic<size_t> num_calls = 0;
+
+  size_t operator () (int key) const
+  {
+    ++num_calls;
+    return dft_hash_fct<int>(key);
+  }
+};
+
+struct ResizeFixture : public Test
+{
+  static bool miss_handler(const int &key, int *data, int8_t &, void *)
+  {
+    *data = key * 10;
+    return true;
+  }
+};
+
+TEST_F(ResizeFixture, growing_keeps_the_entries)
+{
+  Cache<int, int> cache(100, 60s, 60s, miss_handler);
+  cache.enable_reaping();
+  vector<int *> data_ptrs;
+  for (int i = 0; i < 100; ++i)
+    data_ptrs.push_back(cache.retrieve_from_cache_or_compute(i).first);
+
+  cache.resize(1000);
+  ASSERT_EQ(cache.capacity(), 1000);
+  ASSERT_GE(cache.max_size(), 1000);
+
+  // the entries did not move and they are found while they are migrated
+  for (int i = 0; i < 100; ++i)
+    ASSERT_EQ(cache.retrieve_from_cache_or_compute(i).first, data_ptrs[i]);
+
+  for (int i = 100; i < 1000; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+  ASSERT_EQ(cache.size(), 1000);
+  ASSERT_TRUE(cache.migrate());
+
+  cache.reset_stats();
+  for (int i = 0; i < 1000; ++i)
+    ASSERT_EQ(*cache.retrieve_from_cache_or_compute(i).first, i * 10);
+  ASSERT_EQ(cache.stats().misses, 0);
+
+  cache.remove(5);
+  ASSERT_FALSE(cache.has(5));
+  ASSERT_EQ(cache.size(), 999);
+}
+
+TEST_F(ResizeFixture, shrinking_is_gradual)
+{
+  Cache<int, int> cache(1000, 60s, 60s, miss_handler);
+  for (int i = 0; i < 1000; ++i)
+    cache.retrieve_from_cache_or_compute(i);
+
+  cache.resize(100);
+  ASSERT_EQ(cache.capacity(), 100);
+  ASSERT_EQ(cache.size(), 1000); // nothing is evicted yet
+
+  // every insertion evicts a bounded number of entries
+  size_t prev_size = cache.size();
+  for (int i = 1000; cache.size() > 100; ++i)
+    {
+      cache.retrieve_from_cache_or_compute(i);
+      ASSERT_GE(cache.size() + cache.max_excess_evictions, prev_size);
+      prev_size = cache.size();
+    }
+
+  for (int i = 0; i < 1000; ++i)
+    cache.retrieve_from_cache_or_compute(2000 + i);
+  ASSERT_EQ(cache.size(), 100);
+}
+
+TEST_F(ResizeFixture, keys_are_not_hashed_again)
+{
+  Cache<int, int, std::equal_to<int>, TinyLfuPolicy, SwissIndex, CountingHash>
+    cache(100, 60s, 60s, miss_handler);
+
+  // a lookup hashes its key once, also if it inserts and evicts
+  CountingHash::num_calls = 0;
+  for (int i = 0; i < 300; ++i)
+    cache.retrieve_from_cache_or_compute(i % 150);
+  ASSERT_EQ(CountingHash::num_calls, 300);
+
+  CountingHash::num_calls = 0;
+  cache.resize(10000);
+  ASSERT_NE(cache.old_index, nullptr); // the entries are migrated later
+  while (not cache.migrate(16))
+    ;
+  ASSERT_EQ(cache.old_index, nullptr);
+  ASSERT_EQ(CountingHash::num_calls, 0);
+}
+
+TEST_F(ResizeFixture, shards_do_not_hash_again)
+{
+  ShardedCache<int, int, std::equal_to<int>, LruPolicy, LinearIndex, CountingHash>
+    cache(100, 60s, 60s, miss_handler, 4);
+
+  CountingHash::num_calls = 0;
+  for (int i = 0; i < 300; ++i)
+    cache.retrieve_from_cache_or_compute(i % 150);
+  cache.insert(1000, 10000);
+  ASSERT_TRUE(cache.has(1000));
+  cache.remove(1000);
+  ASSERT_EQ(CountingHash::num_calls, 303);
+
+  vector<int> keys(50);
+  std::iota(keys.begin(), keys.end(), 100);
+  CountingHash::num_calls = 0;
+  cache.retrieve_many(keys);
+  ASSERT_EQ(CountingHash::num_calls, keys.size());
+}
+
+TEST_F(ResizeFixture, resize_while_serving)
+{
+  ShardedCache<int, int> cache(1000, 60s, 60s, miss_handler, 4);
+
+  atomic<bool> done = false;
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t)
+    readers.emplace_back([&cache, &done, t]
+      {
+        for (int i = 0; not done; ++i)
+          {
+            const int key = (i * 7 + t) % 5000;
+            ASSERT_EQ(cache.retrieve_decompressed(key).first, key * 10);
+          }
+      });
+
+  thread observer([&cache, &done]
+    {
+      while (not done) // old and new shard capacities, never a partial sum
+        ASSERT_GE(cache.capacity(), 500);
+    });
+
+  for (size_t capacity: { 4000, 500, 8000, 1000 })
+    {
+      cache.resize(capacity);
+      this_thread::sleep_for(20ms);
+    }
+  done = true;
+  observer.join();
+  for (auto &reader: readers)
+    reader.join();
+
+  ASSERT_EQ(cache.capacity(), 1000);
+  for (int i = 0; i < 4000; ++i)
+    cache.retrieve_from_cache_or_compute(10000 + i);
+  ASSERT_LE(cache.size(), cache.capacity());
 }
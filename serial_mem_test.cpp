@@ -8,3 +8,66 @@
 
 # include "serial_men.H"
 
+using namespace testing;
+
+TEST(SerialMemory, size_classes)
+{
+  ASSERT_EQ(SerialMemory::size_class(0), 0);
+  ASSERT_EQ(SerialMemory::size_class(16), 0);
+  ASSERT_EQ(SerialMemory::block_size(1), 20);
+  ASSERT_EQ(SerialMemory::block_size(4), 32);
+
+  // the class of n is the smallest one holding n bytes, and it wastes
+  // less than a quarter of the block
+  for (size_t n = 1; n < 100000; ++n)
+    {
+      const size_t c = SerialMemory::size_class(n);
+      ASSERT_GE(SerialMemory::block_size(c), n);
+      ASSERT_TRUE(c == 0 or SerialMemory::block_size(c - 1) < n);
+      ASSERT_TRUE(c == 0 or 4 * (SerialMemory::block_size(c) - n) < SerialMemory::block_size(c));
+    }
+}
+
+struct SerialMemoryFixture : public Test
+{
+  string file_name = TempDir() + "serial_mem_test.arena";
+
+  SerialMemory memory = SerialMemory(file_name, 1 << 16);
+
+  ~SerialMemoryFixture() { std::remove(file_name.c_str()); }
+};
+
+TEST_F(SerialMemoryFixture, store_and_release)
+{
+  const string a(100, 'a');
+  const string b(30, 'b');
+  const uint64_t off_a = memory.store(a);
+  const uint64_t off_b = memory.store(b);
+  ASSERT_NE(off_a, SerialMemory::npos);
+  ASSERT_NE(off_b, SerialMemory::npos);
+
+  auto bytes_a = memory.bytes(off_a, a.size());
+  ASSERT_EQ(string(bytes_a.begin(), bytes_a.end()), a);
+  auto bytes_b = memory.bytes(off_b, b.size());
+  ASSERT_EQ(string(bytes_b.begin(), bytes_b.end()), b);
+  ASSERT_EQ(memory.offset_of(bytes_b.data()), off_b);
+  ASSERT_EQ(memory.bytes_used(), 112 + 32);
+
+  // a released block is reused by any value of its class
+  memory.release(off_a, a.size());
+  ASSERT_EQ(memory.bytes_used(), 32);
+  const uint64_t off_c = memory.store(string(97, 'c'));
+  ASSERT_EQ(off_c, off_a);
+  ASSERT_EQ(memory.bytes_reserved(), 112 + 32);
+}
+
+TEST_F(SerialMemoryFixture, full)
+{
+  const string value(1000, 'x'); // blocks of 1024 bytes
+  for (int i = 0; i < 64; ++i)
+    ASSERT_NE(memory.store(value), SerialMemory::npos);
+  ASSERT_EQ(memory.store(value), SerialMemory::npos);
+
+  memory.release(5 * 1024, value.size());
+  ASSERT_EQ(memory.store(value), 5 * 1024);
+}